@@ -0,0 +1,363 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <array>
+#include <vector>
+#include <string>
+#include <random>
+#include <ostream>
+#include <sstream>
+
+#include "ChipState.h"
+#include "ChipSprite.h"
+#include "Quirks.h"
+
+// ahead of time compilation of a ROM to a C++ translation unit, linked into the headless runner (ChipAOTRunner.cpp).
+// code reachable from 0x200 is compiled into blocks chained with gotos. 00EE and BNNN go through a switch over the
+// compiled block starts, anything else (FX0A, jumps into unreached code, code the ROM has modified) returns to the
+// runner, which interprets one instruction and tries again.
+namespace ChipAOT
+{
+	// defined by the generated translation unit.
+	extern const uint64_t ROM_HASH;
+	extern const uint8_t QUIRKS;
+
+	// runs compiled blocks from s.pc while the budget covers them, returns what's left of it.
+	int64_t run(ChipState& s, int64_t budget);
+
+	// called after a store to [addr, addr + length), compiled or interpreted. returns whether it changed compiled
+	// code, whose blocks are interpreted from then on.
+	bool noteWrite(const ChipState& s, uint16_t addr, int length);
+
+	inline uint64_t hashRAM(const std::array<uint8_t, ChipState::RAM_SIZE>& ram)
+	{
+		uint64_t hash = 0xCBF29CE484222325;
+
+		for (uint8_t byte : ram)
+			hash = (hash ^ byte) * 0x100000001B3;
+
+		return hash;
+	}
+
+	// quirks are baked into the generated code, the runner sets its own to match.
+	inline uint8_t packQuirks()
+	{
+		return Quirks::Pack();
+	}
+
+	inline void unpackQuirks(uint8_t quirks)
+	{
+		Quirks::VFReset = quirks & 1;
+		Quirks::MemoryIncrement = quirks & 2;
+		Quirks::Clipping = quirks & 4;
+		Quirks::Shifting = quirks & 8;
+		Quirks::Jumping = quirks & 16;
+	}
+
+	inline uint8_t random()
+	{
+		static std::default_random_engine engine { std::random_device{}() };
+		return static_cast<uint8_t>(std::uniform_int_distribution<>{ 0, 255 }(engine));
+	}
+
+	// RAM is tracked in 16-byte lines, a store to a line with compiled code compares it to the ROM image.
+	constexpr int LINE_SHIFT = 4;
+	constexpr int LINES = ChipState::RAM_SIZE >> LINE_SHIFT;
+
+	inline std::string hex(uint64_t value, int digits = 3)
+	{
+		char text[24];
+		std::snprintf(text, sizeof(text), "0x%0*llX", digits, static_cast<unsigned long long>(value));
+		return text;
+	}
+
+	inline std::string label(uint16_t pc)
+	{
+		char text[8];
+		std::snprintf(text, sizeof(text), "L%03X", pc);
+		return text;
+	}
+
+	inline uint16_t opcodeAt(const std::array<uint8_t, ChipState::RAM_SIZE>& ram, uint16_t pc)
+	{
+		return (ram[pc] << 8) | ram[pc + 1];
+	}
+
+	inline bool isSkip(uint16_t opcode)
+	{
+		switch (opcode & 0xF000)
+		{
+		case 0x3000: case 0x4000: return true;
+		case 0x5000: case 0x9000: return (opcode & 0xF) == 0;
+		case 0xE000: return (opcode & 0xFF) == 0x9E || (opcode & 0xFF) == 0xA1;
+		default: return false;
+		}
+	}
+
+	// instructions that leave the block, the next one is only reached through a label.
+	inline bool endsBlock(uint16_t opcode)
+	{
+		return isSkip(opcode) || opcode == 0x00EE || (opcode & 0xF000) == 0x1000 || (opcode & 0xF000) == 0x2000 ||
+			(opcode & 0xF000) == 0xB000 || (opcode & 0xF0FF) == 0xF00A;
+	}
+
+	// an instruction needs a full opcode inside RAM, the interpreter reads past the end otherwise.
+	inline bool compilable(uint16_t pc) { return pc < ChipState::RAM_SIZE - 1; }
+
+	struct Program
+	{
+		std::array<bool, ChipState::RAM_SIZE> code{};    // an instruction starts here
+		std::array<bool, ChipState::RAM_SIZE> leaders{}; // a block starts here
+	};
+
+	inline Program walk(const std::array<uint8_t, ChipState::RAM_SIZE>& ram)
+	{
+		Program program{};
+		std::vector<uint16_t> work { 0x200 };
+
+		program.leaders[0x200] = true;
+
+		const auto branch = [&](uint16_t target)
+		{
+			if (!compilable(target)) return;
+
+			program.leaders[target] = true;
+			work.push_back(target);
+		};
+
+		while (!work.empty())
+		{
+			const uint16_t pc = work.back();
+			work.pop_back();
+
+			if (program.code[pc]) continue;
+			program.code[pc] = true;
+
+			const uint16_t opcode = opcodeAt(ram, pc);
+			const uint16_t next = pc + 2;
+
+			if (isSkip(opcode))
+			{
+				branch(next);
+				branch(next + 2);
+			}
+			else if ((opcode & 0xF000) == 0x1000)
+				branch(opcode & 0xFFF);
+			else if ((opcode & 0xF000) == 0x2000)
+			{
+				branch(opcode & 0xFFF);
+				branch(next); // entered by 00EE through the switch
+			}
+			else if (opcode == 0x00EE || (opcode & 0xF000) == 0xB000 || (opcode & 0xF0FF) == 0xF00A)
+				continue;
+			else if (compilable(next))
+				work.push_back(next);
+		}
+
+		return program;
+	}
+
+	// the statements of one instruction, semantics match ChipInterpretCore::execute().
+	inline std::string emitInstr(uint16_t pc, uint16_t opcode, const Program& program, int remaining)
+	{
+		const std::string X = "s.V[" + std::to_string((opcode >> 8) & 0xF) + "]";
+		const std::string Y = "s.V[" + std::to_string((opcode >> 4) & 0xF) + "]";
+		const std::string NN = hex(opcode & 0xFF, 2), NNN = hex(opcode & 0xFFF);
+		const int x = (opcode >> 8) & 0xF;
+		const uint16_t next = pc + 2;
+
+		// a branch to code that isn't compiled leaves through the runner.
+		const auto jump = [&](uint16_t target)
+		{
+			return target < ChipState::RAM_SIZE && program.leaders[target] ? "goto " + label(target) + ";" :
+				"{ s.pc = " + hex(target) + "; return budget; }";
+		};
+		const auto skip = [&](const std::string& condition)
+		{
+			return "if (" + condition + ") " + jump(next + 2) + "\n\t" + jump(next);
+		};
+		const auto flag = [&](const std::string& value) { return Quirks::VFReset ? value + " s.V[0xF] = 0;" : value; };
+		const auto shift = [&](const std::string& body) { return "{ " + (Quirks::Shifting ? "" : X + " = " + Y + "; ") + body + " }"; };
+
+		// stores to compiled code leave the block, the following instructions may have changed.
+		const auto store = [&](int length, const std::string& body)
+		{
+			return "{ const uint16_t addr = s.I; " + body + " if (noteWrite(s, addr, " + std::to_string(length) + ")) { s.pc = " + hex(next) +
+				"; return budget + " + std::to_string(remaining) + "; } }";
+		};
+		const std::string increment = Quirks::MemoryIncrement ? " s.I += " + std::to_string(x + 1) + ";" : "";
+
+		switch (opcode & 0xF000)
+		{
+		case 0x0000:
+			if (opcode == 0x00E0) return "s.screenBuffer.fill(0);";
+			if (opcode == 0x00EE) return "s.pc = s.stack[(--s.sp) & 0xF] & 0xFFF; goto dispatch;";
+			return "";
+		case 0x1000: return jump(opcode & 0xFFF);
+		case 0x2000: return "s.stack[(s.sp++) & 0xF] = " + hex(next) + "; " + jump(opcode & 0xFFF);
+		case 0x3000: return skip(X + " == " + NN);
+		case 0x4000: return skip(X + " != " + NN);
+		case 0x5000: return (opcode & 0xF) == 0 ? skip(X + " == " + Y) : "";
+		case 0x6000: return X + " = " + NN + ";";
+		case 0x7000: return X + " += " + NN + ";";
+		case 0x8000:
+			switch (opcode & 0xF)
+			{
+			case 0x0: return X + " = " + Y + ";";
+			case 0x1: return flag(X + " |= " + Y + ";");
+			case 0x2: return flag(X + " &= " + Y + ";");
+			case 0x3: return flag(X + " ^= " + Y + ";");
+			case 0x4: return "{ const int result = " + X + " + " + Y + "; " + X + " = result; s.V[0xF] = result > 255; }";
+			case 0x5: return "{ const int result = " + X + " - " + Y + "; " + X + " = result; s.V[0xF] = result >= 0; }";
+			case 0x6: return shift("const uint8_t lsb = " + X + " & 1; " + X + " >>= 1; s.V[0xF] = lsb;");
+			case 0x7: return X + " = " + Y + " - " + X + "; s.V[0xF] = " + Y + " >= " + X + ";";
+			case 0xE: return shift("const uint8_t msb = (" + X + " & 0x80) >> 7; " + X + " <<= 1; s.V[0xF] = msb;");
+			default: return "";
+			}
+		case 0x9000: return (opcode & 0xF) == 0 ? skip(X + " != " + Y) : "";
+		case 0xA000: return "s.I = " + NNN + ";";
+		case 0xB000: return "s.pc = (" + (Quirks::Jumping ? X : std::string("s.V[0]")) + " + " + NNN + ") & 0xFFF; goto dispatch;";
+		case 0xC000: return X + " = ChipAOT::random() & " + NN + ";";
+		case 0xD000:
+			return "s.V[0xF] = ChipSprite::draw(s, " + X + " % ChipState::SCRWidth, " + Y + " % ChipState::SCRHeight, " +
+				std::to_string(opcode & 0xF) + ", " + (Quirks::Clipping ? "true" : "false") + ");";
+		case 0xE000:
+			if ((opcode & 0xFF) == 0x9E) return skip("s.keys[" + X + " & 0xF]");
+			if ((opcode & 0xFF) == 0xA1) return skip("!s.keys[" + X + " & 0xF]");
+			return "";
+		case 0xF000:
+			switch (opcode & 0xFF)
+			{
+			case 0x07: return X + " = s.delay_timer;";
+			case 0x15: return "s.delay_timer = " + X + ";";
+			case 0x18: return "s.sound_timer = " + X + ";";
+			case 0x1E: return "s.I += " + X + ";";
+			case 0x29: return "s.I = (" + X + " & 0xF) * 0x5;";
+			case 0x33:
+				return store(3, "s.RAM[addr & 0xFFF] = " + X + " / 100; s.RAM[(addr + 1) & 0xFFF] = (" + X + " / 10) % 10; s.RAM[(addr + 2) & 0xFFF] = " +
+					X + " % 10;");
+			case 0x55:
+				return store(x + 1, "for (int i = 0; i <= " + std::to_string(x) + "; i++) s.RAM[(addr + i) & 0xFFF] = s.V[i];" + increment);
+			case 0x65:
+				return "for (int i = 0; i <= " + std::to_string(x) + "; i++) s.V[i] = s.RAM[(s.I + i) & 0xFFF];" + increment;
+			default: return "";
+			}
+		default: return "";
+		}
+	}
+
+	// writes the translation unit for the ROM loaded into ram.
+	inline bool generate(const std::array<uint8_t, ChipState::RAM_SIZE>& ram, const std::string& name, std::ostream& out)
+	{
+		const Program program = walk(ram);
+
+		std::array<bool, LINES> codeLines{};
+
+		for (int pc = 0; pc < ChipState::RAM_SIZE; pc++)
+		{
+			if (!program.code[pc]) continue;
+
+			codeLines[pc >> LINE_SHIFT] = true;
+			codeLines[(pc + 1) >> LINE_SHIFT] = true;
+		}
+
+		out << "// generated by MegaJIT-8 --aot from " << name << ", link it into the MegaJIT_8_AOT runner.\n";
+		out << "#include \"ChipAOT.h\"\n\n";
+		out << "const uint64_t ChipAOT::ROM_HASH = " << hex(hashRAM(ram), 16) << ";\n";
+		out << "const uint8_t ChipAOT::QUIRKS = " << hex(packQuirks(), 2) << ";\n\n";
+
+		out << "namespace\n{\n";
+		out << "\tconstexpr uint8_t ROM[ChipState::RAM_SIZE] =\n\t{";
+
+		for (int i = 0; i < ChipState::RAM_SIZE; i++)
+			out << (i % 32 == 0 ? "\n\t\t" : " ") << hex(ram[i], 2) << ",";
+
+		out << "\n\t};\n\n";
+		out << "\tconstexpr bool CODE_LINES[ChipAOT::LINES] =\n\t{";
+
+		for (int i = 0; i < LINES; i++)
+			out << (i % 32 == 0 ? "\n\t\t" : " ") << codeLines[i] << ",";
+
+		out << "\n\t};\n\n";
+		out << "\t// compiled lines that differ from the ROM, their blocks are interpreted.\n";
+		out << "\tbool modified[ChipAOT::LINES]{};\n";
+		out << "\tint modifiedCount { 0 };\n\n";
+		out << "\tbool anyModified(int first, int last)\n\t{\n";
+		out << "\t\tfor (int line = first; line <= last; line++)\n\t\t\tif (modified[line]) return true;\n\n";
+		out << "\t\treturn false;\n\t}\n}\n\n";
+		out << "bool ChipAOT::noteWrite(const ChipState& s, uint16_t addr, int length)\n{\n";
+		out << "\tbool changed { false };\n\n";
+		out << "\tfor (int i = (addr & 0xFFF) >> ChipAOT::LINE_SHIFT; i <= ((addr & 0xFFF) + length - 1) >> ChipAOT::LINE_SHIFT; i++)\n\t{\n";
+		out << "\t\tconst int line = i & (ChipAOT::LINES - 1);\n";
+		out << "\t\tif (!CODE_LINES[line]) continue;\n\n";
+		out << "\t\tconst bool differs = std::memcmp(&s.RAM[line << ChipAOT::LINE_SHIFT], &ROM[line << ChipAOT::LINE_SHIFT], 1 << ChipAOT::LINE_SHIFT) != 0;\n";
+		out << "\t\tmodifiedCount += differs - modified[line];\n";
+		out << "\t\tmodified[line] = differs;\n";
+		out << "\t\tchanged |= differs;\n\t}\n\n";
+		out << "\treturn changed;\n}\n\n";
+
+		// the blocks are written first, the dispatch label is only emitted when a 00EE or BNNN jumps back to it.
+		std::ostringstream blocks{};
+		bool dispatches { false };
+
+		for (int leader = 0; leader < ChipState::RAM_SIZE; leader++)
+		{
+			if (!program.leaders[leader]) continue;
+
+			// the instructions of the block: up to one that leaves it, or to the next block.
+			std::vector<uint16_t> instrs { static_cast<uint16_t>(leader) };
+
+			while (!endsBlock(opcodeAt(ram, instrs.back())))
+			{
+				const uint16_t next = instrs.back() + 2;
+				if (!compilable(next) || program.leaders[next]) break;
+
+				instrs.push_back(next);
+			}
+
+			// FX0A waits for a key through the interpreter.
+			const bool waits = (opcodeAt(ram, instrs.back()) & 0xF0FF) == 0xF00A;
+			const int count = static_cast<int>(instrs.size()) - waits;
+			const int firstLine = leader >> LINE_SHIFT, lastLine = (instrs.back() + 1) >> LINE_SHIFT;
+
+			blocks << "\n" << label(leader) << ":\n";
+			blocks << "\tif (budget < " << count << " || (modifiedCount != 0 && anyModified(" << firstLine << ", " << lastLine << "))) { s.pc = " <<
+				hex(leader) << "; return budget; }\n";
+
+			if (count > 0)
+				blocks << "\tbudget -= " << count << ";\n";
+
+			for (int i = 0; i < count; i++)
+			{
+				const uint16_t opcode = opcodeAt(ram, instrs[i]);
+				const std::string code = emitInstr(instrs[i], opcode, program, count - i - 1);
+				if (!code.empty()) blocks << "\t" << code << "\n";
+
+				dispatches |= opcode == 0x00EE || (opcode & 0xF000) == 0xB000;
+			}
+
+			const uint16_t last = instrs.back();
+
+			if (waits)
+				blocks << "\ts.pc = " << hex(last) << "; return budget;\n";
+			else if (!endsBlock(opcodeAt(ram, last)))
+				blocks << "\t" << (program.leaders[last + 2] && compilable(last + 2) ? "goto " + label(last + 2) + ";" : "s.pc = " + hex(last + 2) + "; return budget;") << "\n";
+		}
+
+		out << "int64_t ChipAOT::run(ChipState& s, int64_t budget)\n{\n";
+		out << (dispatches ? "dispatch:\n" : "") << "\tswitch (s.pc)\n\t{\n";
+
+		for (int pc = 0; pc < ChipState::RAM_SIZE; pc++)
+		{
+			if (program.leaders[pc])
+				out << "\tcase " << hex(pc) << ": goto " << label(pc) << ";\n";
+		}
+
+		out << "\tdefault: return budget;\n\t}\n";
+		out << blocks.str() << "}\n";
+
+		return static_cast<bool>(out);
+	}
+}
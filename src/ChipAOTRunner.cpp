@@ -0,0 +1,72 @@
+// headless runner for a ROM compiled ahead of time with MegaJIT-8 --aot <rom>, the generated translation unit
+// is linked in by configuring with -DCHIP_AOT_SOURCE=<rom>.cpp.
+// usage: MegaJIT_8_AOT <rom> [frames] [instructions per frame], prints the screen after the last frame.
+#include <iostream>
+#include <string>
+
+#include "ChipAOT.h"
+#include "ChipInterpretCore.h"
+
+int main(int argc, char* argv[])
+{
+    if (argc < 2)
+    {
+        std::cout << "Usage: " << argv[0] << " <rom> [frames] [instructions per frame]" << std::endl;
+        return 1;
+    }
+
+    const long frames = argc > 2 ? std::stol(argv[2]) : 600;
+    const long IPF = argc > 3 ? std::stol(argv[3]) : 1000;
+
+    ChipInterpretCore interpreter{};
+
+    if (!interpreter.loadROM(argv[1]))
+    {
+        std::cout << "Failed to load " << argv[1] << std::endl;
+        return 1;
+    }
+
+    if (ChipAOT::hashRAM(s.RAM) != ChipAOT::ROM_HASH)
+    {
+        std::cout << argv[1] << " is not the ROM this runner was compiled for" << std::endl;
+        return 1;
+    }
+
+    ChipAOT::unpackQuirks(ChipAOT::QUIRKS);
+
+    for (long frame = 0; frame < frames; frame++)
+    {
+        interpreter.updateTimers();
+        int64_t budget = IPF;
+
+        while (budget > 0)
+        {
+            budget = ChipAOT::run(s, budget);
+
+            if (budget > 0)
+            {
+                // interpreted stores can rewrite compiled code too.
+                const uint16_t opcode = (s.RAM[s.pc & 0xFFF] << 8) | s.RAM[(s.pc + 1) & 0xFFF];
+                const uint16_t addr = s.I;
+
+                interpreter.execute();
+                budget--;
+
+                if ((opcode & 0xF0FF) == 0xF033)
+                    ChipAOT::noteWrite(s, addr, 3);
+                else if ((opcode & 0xF0FF) == 0xF055)
+                    ChipAOT::noteWrite(s, addr, ((opcode & 0x0F00) >> 8) + 1);
+            }
+        }
+    }
+
+    for (uint64_t row : s.screenBuffer)
+    {
+        for (int x = 0; x < ChipState::SCRWidth; x++)
+            std::cout << ((row >> (ChipState::SCRWidth - 1 - x)) & 1 ? '#' : '.');
+
+        std::cout << "\n";
+    }
+
+    return 0;
+}
@@ -1,13 +1,21 @@
 #pragma once
 
+#include <array>
 #include <vector>
 #include <cstring>
 #include <algorithm>
 #include <numeric>
+#include <bit>
+#include <functional>
 
 #include <xbyak/xbyak.h>
 #include <xbyak/xbyak_util.h>
 
+#if defined(__linux__)
+#include <cstdlib>
+#include <sys/mman.h>
+#endif
+
 #include "ChipState.h"
 #include "ChipJITState.h"
 #include "Quirks.h"
@@ -16,6 +24,40 @@
 extern ChipState s;
 extern ChipJITState JIT;
 
+// instruction set levels the emitter generates code for, each one includes the ones below.
+enum class CPUTier : uint8_t
+{
+	Baseline, // no vector code.
+	SSE2,
+	AVX,
+	AVX2, // with BMI1 and BMI2.
+	AVX512
+};
+
+constexpr std::array<const char*, 5> CPU_TIER_NAMES { "baseline", "sse2", "avx", "avx2", "avx512" };
+
+#if defined(__linux__)
+// backs the code cache with transparent huge pages where the kernel allows it, so one iTLB entry covers 2 MiB of blocks.
+// elsewhere the cache uses xbyak's default page allocation.
+struct HugePageAllocator : Xbyak::Allocator
+{
+	static constexpr size_t HUGE_PAGE_SIZE = 2 * 1024 * 1024;
+
+	uint8_t* alloc(size_t size) override
+	{
+		void* code { nullptr };
+
+		if (posix_memalign(&code, HUGE_PAGE_SIZE, size) != 0)
+			return nullptr;
+
+		madvise(code, size, MADV_HUGEPAGE);
+		return static_cast<uint8_t*>(code);
+	}
+
+	void free(uint8_t* code) override { std::free(code); }
+};
+#endif
+
 class ChipEmitter : Xbyak::CodeGenerator
 {
 private:
@@ -33,70 +75,116 @@ private:
 #endif
 
 #define BASE r11
-#define BRANCH_SKIP_REG r10
+#define BUDGET_REG r10
+#define PC si
+#define PC_FULL_REG rsi
+#define I_REG r15w
+#define I_FULL_REG r15
 
 #define SP word[BASE + offsetof(ChipState, sp)]
-#define PC word[BASE + offsetof(ChipState, pc)]
+#define PC_PTR word[BASE + offsetof(ChipState, pc)]
 #define STACK_PTR word[BASE + offsetof(ChipState, stack) + (rcx * sizeof(uint16_t))]
 #define KEY(offset) byte[BASE + offsetof(ChipState, keys) + offset]
 #define REG_PTR(num) byte[BASE + offsetof(ChipState, V) + num]
 #define I_REG_PTR word[BASE + offsetof(ChipState, I)]
 #define RAM_PTR(offset) byte[BASE + offsetof(ChipState, RAM) + offset]
 
-#ifdef _WIN32
-	static constexpr uint8_t MAX_ALLOC_REGS = 6;
-#else
-	static constexpr uint8_t MAX_ALLOC_REGS = 5;
-#endif
+	// V registers pinned to host registers for as long as the dispatcher runs, the flag register first.
+	static constexpr std::array<uint8_t, 5> PINNED_REGS = { 0xF, 0x0, 0x1, 0x2, 0x3 };
+	static constexpr uint16_t PINNED_MASK = (1 << 0xF) | (1 << 0x0) | (1 << 0x1) | (1 << 0x2) | (1 << 0x3);
+
+	// host register currently holding each V register, nullptr while it lives in memory.
+	std::array<const Xbyak::Reg8*, 16> heldRegs{};
+	std::array<bool, 16> dirtyRegs{};
 
-	std::vector<uint8_t> allocatedRegs{};
-	bool IregAllocated{ false };
-	bool flagRegAllocated{ false };
 	uint64_t blockBranches { 0 };
 
-#define I_FULL_REG r15
+	const Xbyak::Reg8* Vreg{ nullptr };
 
-	const Xbyak::Operand& V_FULL_REG(uint8_t num)
+	inline bool GET_VREG(uint8_t num) 
 	{
-		switch (num)
-		{
-			case 0: return bx;
-			case 1: return bp;
-			case 2: return r12w;
-			case 3: return r13w;
-			case 4: return r14w;
-			case 5: return di;
-			default: UNREACHABLE()
-		}
+		Vreg = heldRegs[num];
+		return Vreg != nullptr;
 	}
 
-	const Xbyak::Reg8* Vreg{ nullptr };
+	// a non-pinned V register kept in a caller-saved host register over [start, end] of the decoded block.
+	struct LiveInterval
+	{
+		uint8_t reg{};
+		size_t start{};
+		size_t end{};
+		bool load{};
+		const Xbyak::Reg8* host{ nullptr };
+		int accesses{};
+	};
 
-	inline bool GET_VREG(uint8_t num) 
+	std::vector<LiveInterval> intervals{};
+	uint16_t carriedRegs{}; // held around the back-edge of a self loop, dirty from the loop head on
+
+	// values of the V registers and I known at compile time, only valid within the block being emitted.
+	static constexpr int32_t UNKNOWN = -1;
+
+	std::array<int32_t, 16> knownRegs{};
+	int32_t knownI{ UNKNOWN };
+
+	// guest data baked into the code of the block being emitted, it's invalidated together with the code.
+	std::vector<JITRange> dataRanges{};
+
+	// guest PCs the exit stubs of the block being emitted jump to, other than those of its cold paths.
+	std::vector<uint16_t> exitPCs{};
+
+	// what the block being emitted adds to the JIT state, registered by publishBlock(). the compiler thread emits
+	// without touching the tables compiled code uses.
+	struct ExitStub
 	{
-		auto pos = std::find(allocatedRegs.begin(), allocatedRegs.end(), num);
+		uint16_t pc;
+		uint8_t* stub;
+	};
 
-		if (pos != allocatedRegs.end())
-		{
-			switch (std::distance(allocatedRegs.begin(), pos))
-			{
-				case 0: Vreg = &bl; break;
-				case 1: Vreg = &bpl; break;
-				case 2: Vreg = &r12b; break;
-				case 3: Vreg = &r13b; break;
-				case 4: Vreg = &r14b; break;
-				case 5: Vreg = &sil; break;
-			}
+	struct PendingCache
+	{
+		InlineCache cache;
+		size_t indexOffset; // of the imm32 the cache's index is patched into
+	};
 
-			return true;
-		}
+	std::vector<ExitStub> exitStubs{};
+	std::vector<PendingCache> pendingCaches{};
+	std::vector<CodeRelocation> relocations{};
+
+	// rarely taken paths of the block being emitted, placed after its last exit by finishBlock() to keep the hot path
+	// dense. each is emitted with the register state and instruction count of the point it branches from.
+	struct ColdPath
+	{
+		Xbyak::Label entry;
+		std::array<const Xbyak::Reg8*, 16> heldRegs;
+		std::array<bool, 16> dirtyRegs;
+		uint64_t instructions;
+		uint64_t blockBranches;
+		std::function<void()> body;
+	};
+
+	std::vector<ColdPath> coldPaths{};
+
+	template <typename Func>
+	inline void emitCold(const Xbyak::Label& entry, Func body)
+	{
+		coldPaths.push_back(ColdPath{ entry, heldRegs, dirtyRegs, instructions, blockBranches, body });
+	}
+
+	// state before a skipped instruction, merged back in at the skip label.
+	std::array<int32_t, 16> skipKnownRegs{};
+	int32_t skipKnownI{ UNKNOWN };
 
-		return false;
+	inline bool isKnown(uint8_t reg) const { return knownRegs[reg] != UNKNOWN; }
+
+	inline void forgetKnown()
+	{
+		knownRegs.fill(UNKNOWN);
+		knownI = UNKNOWN;
 	}
 
 #define V_REG(num) (GET_VREG(num) ? (const Xbyak::Operand&)*Vreg : (const Xbyak::Operand&)REG_PTR(num))
-#define I_REG (IregAllocated ? (const Xbyak::Operand&)r15w : (const Xbyak::Operand&)I_REG_PTR)
-#define FLAG_REG (flagRegAllocated ? (const Xbyak::Operand&)bl : (const Xbyak::Operand&)REG_PTR(0xF))
+#define FLAG_REG V_REG(0xF)
 
 	template <typename Op>
 	inline void PerformOp(const Xbyak::Operand& op1, const Xbyak::Operand& op2, Op op)
@@ -149,6 +237,17 @@ private:
 	inline void callFunc(size_t func)
 	{
 		mov(rax, func);
+		callRax();
+	}
+
+	inline void callFunc(CodeAddress func)
+	{
+		movAddress(rax, func);
+		callRax();
+	}
+
+	inline void callRax()
+	{
 #ifdef _WIN32
 		sub(rsp, 32);
 #endif
@@ -158,411 +257,1873 @@ private:
 #endif
 	}
 
+	// the placeholder doesn't fit in 32 bits, so the address always gets the 8-byte immediate it's patched in as.
+	inline void movAddress(const Xbyak::Reg64& reg, CodeAddress target)
+	{
+		mov(reg, 0x7FFFFFFFFFFFFFFF);
+
+		const size_t offset = getSize() - sizeof(uint64_t);
+		rewrite(offset, addressOf(target), sizeof(uint64_t));
+		relocations.push_back(CodeRelocation{ static_cast<uint32_t>(offset), target });
+	}
+
+	static size_t addressOf(CodeAddress target)
+	{
+		switch (target)
+		{
+		case CodeAddress::CodeLines: return reinterpret_cast<size_t>(JIT.codeLines.data());
+		case CodeAddress::ShadowStack: return reinterpret_cast<size_t>(JIT.shadowStack.data());
+		case CodeAddress::InvalidateBlocks: return reinterpret_cast<size_t>(invalidateBlocks);
+		case CodeAddress::UpdateInlineCache: return reinterpret_cast<size_t>(updateInlineCache);
+		case CodeAddress::EntryCounters: return reinterpret_cast<size_t>(JIT.entryCounters.data());
+		case CodeAddress::SkipBias: return reinterpret_cast<size_t>(JIT.skipBias.data());
+		case CodeAddress::PromoteBlock: return reinterpret_cast<size_t>(promoteBlock);
+		case CodeAddress::TierUpBlock: return reinterpret_cast<size_t>(tierUpBlock);
+		default: UNREACHABLE();
+		}
+	}
+
+	// BASE, the budget and PC live in caller-saved registers, the padding keeps calls 16-byte aligned.
+	inline void pushGuestState()
+	{
+		push(BASE);
+		push(BUDGET_REG);
+		push(PC_FULL_REG);
+		sub(rsp, 8);
+	}
+	inline void popGuestState()
+	{
+		add(rsp, 8);
+		pop(PC_FULL_REG);
+		pop(BUDGET_REG);
+		pop(BASE);
+	}
+
+	// FX55/FX65 over V0..V[count]. with AVX a long FX65 moves the V file with one 16-byte load, the held registers
+	// are extracted from it. FX55, and FX65 after a store in the same block, stay bytewise: a wide load over bytes
+	// just stored misses store forwarding and is slower than the byte moves. a range wrapping past 0xFFF is copied bytewise.
 	template<bool toMem>
 	inline void store(uint8_t count)
 	{
-		movzx(rdx, I_REG);
-
-		for (int i = 0; i <= count; i++)
+		// short ranges are mostly pinned registers, the byte moves are cheaper there.
+		if (toMem || ramStored || !hasTier(CPUTier::AVX) || count < 7)
 		{
-			lea(rax, ptr[rdx + i]);
-			and_(rax, 0xFFF);
+			storeBytes<toMem>(count);
+			return;
+		}
+		const int limit = ChipState::RAM_SIZE - 16;
 
-			if constexpr (toMem)
-				MOV(RAM_PTR(rax), V_REG(i));
+		if (knownI != UNKNOWN)
+		{
+			if ((knownI & 0xFFF) <= limit)
+				loadVector(count, BASE + (offsetof(ChipState, RAM) + (knownI & 0xFFF)));
 			else
-				MOV(V_REG(i), RAM_PTR(rax));
+				storeBytes<toMem>(count);
+
+			return;
 		}
+
+		Xbyak::Label wrap, end;
+
+		movzx(edx, I_REG);
+		and_(edx, 0xFFF);
+		cmp(edx, limit);
+		ja(wrap, T_NEAR);
+
+		loadVector(count, BASE + offsetof(ChipState, RAM) + rdx);
+		jmp(end, T_NEAR);
+
+		L(wrap);
+		storeBytes<toMem>(count);
+		L(end);
 	}
 
-	static void invalidateBlocks(uint16_t startAddr, uint16_t endAddr)
+	inline void loadVector(uint8_t count, const Xbyak::RegExp& address)
 	{
-		for (auto& block : JIT.blocks)
+		vmovdqu(xmm0, ptr[address]);
+		storePartial(BASE + offsetof(ChipState, V), count + 1);
+
+		for (int i = 0; i <= count; i++)
 		{
-			if (block.startPC <= endAddr && block.endPC >= startAddr)
-				JIT.blockMap[block.startPC].isValid = false;
+			if (heldRegs[i] != nullptr)
+				vpextrb(heldRegs[i]->cvt32(), xmm0, i);
+
+			knownRegs[i] = UNKNOWN;
 		}
 	}
 
-	inline void resetState()
+	// stores the low length bytes of xmm0, with at most two overlapping stores.
+	inline void storePartial(const Xbyak::RegExp& address, int length)
 	{
-		allocatedRegs.clear();
-		std::memset(VRegUsage.data(), 0, sizeof(VRegUsage));
-		IRegUsage = 0;
-		IregAllocated = false;
-		flagRegAllocated = false;
-		instructions = 0;
-		blockBranches = 0;
+		const auto storeTwo = [&](int size, auto storeOp)
+		{
+			storeOp(ptr[address], xmm0);
+
+			if (length > size)
+			{
+				vpsrldq(xmm1, xmm0, length - size);
+				storeOp(ptr[address + (length - size)], xmm1);
+			}
+		};
+
+		if (length == 16)
+			vmovdqu(ptr[address], xmm0);
+		else if (length >= 8)
+			storeTwo(8, [this](const Xbyak::Address& dst, const Xbyak::Xmm& src) { vmovq(dst, src); });
+		else if (length >= 4)
+			storeTwo(4, [this](const Xbyak::Address& dst, const Xbyak::Xmm& src) { vmovd(dst, src); });
+		else if (length >= 2)
+			storeTwo(2, [this](const Xbyak::Address& dst, const Xbyak::Xmm& src) { vpextrw(dst, src, 0); });
+		else
+			vpextrb(ptr[address], xmm0, 0);
 	}
 
-	Xbyak::util::Cpu cpuCaps;
+	template<bool toMem>
+	inline void storeBytes(uint8_t count)
+	{
+		if (knownI == UNKNOWN)
+			movzx(rdx, I_REG);
+
+		for (int i = 0; i <= count; i++)
+		{
+			if (knownI == UNKNOWN)
+			{
+				lea(rax, ptr[rdx + i]);
+				and_(rax, 0xFFF);
+			}
 
-	bool SSE2Support { false };
-	bool AVXSupport { false };
+			const int32_t offset = (knownI + i) & 0xFFF;
+			const auto& address = knownI != UNKNOWN ? RAM_PTR(offset) : RAM_PTR(rax);
 
-	inline void checkCPUSupport()
+			if constexpr (toMem)
+			{
+				if (isKnown(i))
+					mov(address, knownRegs[i]);
+				else
+					MOV(address, V_REG(i));
+			}
+			else
+			{
+				MOV(V_REG(i), address);
+				knownRegs[i] = UNKNOWN;
+			}
+		}
+	}
+
+	// invalidates the blocks covering [startAddr, endAddr], returns whether the block at currentPC was one of them.
+	static bool invalidateBlocks(uint16_t startAddr, uint16_t endAddr, uint16_t currentPC)
 	{
-		cpuCaps = Xbyak::util::Cpu();
+		std::lock_guard lock{ JIT.mutex };
 
-		AVXSupport = cpuCaps.has(Xbyak::util::Cpu::tAVX);
-		SSE2Support = cpuCaps.has(Xbyak::util::Cpu::tSSE2);
-	}
+		const uint16_t length = endAddr - startAddr;
+		startAddr &= 0xFFF;
+		endAddr = startAddr + length;
 
-public:
-	static constexpr uint32_t MAX_CACHE_SIZE = 262144;
+		std::vector<int16_t> hits{};
+
+		for (int line = startAddr >> ChipJITState::LINE_SHIFT; line <= endAddr >> ChipJITState::LINE_SHIFT; line++)
+		{
+			for (int16_t index : JIT.lineBlocks[line & (ChipJITState::LINES - 1)])
+			{
+				const auto& block = JIT.blocks[index];
 
-	std::array<uint8_t, 16> VRegUsage{};
-	uint8_t IRegUsage{ 0 };
+				if (JIT.blockEntries[block.startPC] == nullptr)
+					continue;
 
-	uint64_t instructions { 0 };
+				const bool overlaps = std::any_of(block.ranges.begin(), block.ranges.end(), [=](const JITRange& range) {
+					return range.overlaps(startAddr, endAddr);
+				});
 
-	void allocateRegs()
-	{
-		if (VRegUsage[0xF] >= 3)
+				if (overlaps && std::find(hits.begin(), hits.end(), index) == hits.end())
+					hits.push_back(index);
+			}
+		}
+
+		bool current { false };
+
+		for (int16_t index : hits)
 		{
-			allocatedRegs.push_back(0xF);
-			flagRegAllocated = true;
+			JIT.warmBlocks[JIT.blocks[index].startPC] = 0;
+			dropBlock(index);
+			current |= JIT.blocks[index].startPC == currentPC;
 		}
 
-		for (int i = 0; i < 15; i++)
+		return current;
+	}
+
+	// points the next slot of a BNNN site (round robin) at pc.
+	static void updateInlineCache(uint32_t index, uint16_t pc)
+	{
+		std::lock_guard lock{ JIT.mutex };
+
+		auto& cache = JIT.inlineCaches[index];
+
+		uint8_t* target = cache.targets[cache.next];
+		uint8_t* stub = cache.stubs[cache.next];
+		cache.next = (cache.next + 1) % InlineCache::SLOTS;
+
+		uint16_t oldPC;
+		std::memcpy(&oldPC, target, sizeof(oldPC));
+
+		if (oldPC != InlineCache::EMPTY)
+			std::erase(JIT.blockLinks[oldPC], stub);
+
+		std::memcpy(target, &pc, sizeof(pc));
+		JIT.blockLinks[pc].push_back(stub);
+		linkExit(stub, JIT.blockEntries[pc] != nullptr ? JIT.blockEntries[pc] : stub + 5);
+	}
+
+	// called by a profiled block whose entry counter ran out. it's dropped and recompiled with its profile on its
+	// next miss, so are the successors that are past half of their count, a hot loop over several blocks goes at once.
+	static void promoteBlock(uint16_t pc)
+	{
+		std::lock_guard lock{ JIT.mutex };
+
+		JIT.hotBlocks[pc] = 1;
+
+		for (uint16_t exit : JIT.blocks[JIT.blockMap[pc].block].exits)
 		{
-			if (VRegUsage[i] >= 3)
+			// baseline blocks count down to their tier-up instead.
+			if (JIT.blockEntries[exit] == nullptr || JIT.blocks[JIT.blockMap[exit].block].baseline)
+				continue;
+
+			if (!JIT.hotBlocks[exit] && JIT.entryCounters[exit] <= ChipJITState::HOT_ENTRIES / 2)
 			{
-				allocatedRegs.push_back(i);
-				if (allocatedRegs.size() == MAX_ALLOC_REGS) break;
+				JIT.hotBlocks[exit] = 1;
+				dropBlock(JIT.blockMap[exit].block);
 			}
 		}
 
-		if (IRegUsage >= 3)
-			IregAllocated = true;
+		dropBlock(JIT.blockMap[pc].block);
 	}
 
-	inline void incrementBranches() { blockBranches++; }
+	// the stub comes from emitLinkJump(), the displacement is written with one aligned store.
+	static inline void linkExit(uint8_t* stub, const uint8_t* target)
+	{
+		const int32_t rel = static_cast<int32_t>(target - (stub + 5));
+		std::memcpy(stub + 1, &rel, sizeof(rel));
+	}
 
-	ChipEmitter() : Xbyak::CodeGenerator(MAX_CACHE_SIZE)
+	static inline void unlinkBlock(uint16_t pc)
 	{
-		checkCPUSupport();
+		for (auto stub : JIT.blockLinks[pc])
+			linkExit(stub, stub + 5); // back to the stub's own return path
 	}
 
-	void emitPrologue()
+	const uint8_t* dispatchLoop{ nullptr };
+	const uint8_t* dispatchExhausted{ nullptr };
+	const uint8_t* dispatchExit{ nullptr };
+	size_t dispatcherSize{ 0 };
+
+	size_t budgetCheckOffset{ 0 };
+	std::vector<size_t> loopCheckOffsets{}; // budget checks of back-edges, patched like the entry's
+	const uint8_t* blockEntry{ nullptr };
+	const uint8_t* loopHead{ nullptr }; // after the loads of the intervals starting at the first instruction
+	uint16_t blockStartPC{ 0 };
+
+	// entry point of the cache, kept across cache clears. runs blocks from the current PC (or the given entry)
+	// until the budget can't cover the next block, refilling it while *running is set. returns the number of executed instructions.
+	void emitDispatcher(size_t compileFunc, const void* compileArg)
 	{
+		Xbyak::Label loop, miss, exhausted, exit;
+
+		push(rbx);
+		push(rbp);
+		push(r12);
+		push(r13);
+		push(r14);
+		push(r15);
+#ifdef _WIN32
+		push(rdi);
+		push(rsi);
+#endif
+		sub(rsp, 24); // budget, running flag, instructions of previous refills.
+
+		mov(qword[rsp], ARG1);
+		mov(qword[rsp + 8], ARG2);
+		mov(qword[rsp + 16], 0);
+		mov(BUDGET_REG, ARG1);
+
 		mov(BASE, (size_t)&s);
+		movzx(PC_FULL_REG, PC_PTR);
+		and_(PC_FULL_REG, 0xFFF);
+		movzx(I_FULL_REG, I_REG_PTR);
+
+		for (auto reg : PINNED_REGS)
+			mov(V_REG(reg), REG_PTR(reg));
+
+		test(ARG3, ARG3);
+		jz(loop);
+		jmp(ARG3);
+
+		L(loop);
+		dispatchLoop = getCurr();
+
+		test(BUDGET_REG, BUDGET_REG);
+		jle(exhausted);
+
+		movzx(eax, PC);
+		mov(rcx, (size_t)JIT.blockEntries.data());
+		mov(rax, qword[rcx + rax * sizeof(uint8_t*)]);
+		test(rax, rax);
+		jz(miss);
+		jmp(rax);
+
+		L(miss);
+		pushGuestState();
+		movzx(eax, PC);
+		mov(ARG1, (size_t)compileArg);
+		mov(ARG2, rax);
+		callFunc(compileFunc);
+		popGuestState();
+		jmp(rax);
+
+		L(exhausted);
+		mov(rax, qword[rsp + 8]);
+		test(rax, rax);
+		jz(exit);
+		cmp(byte[rax], 0);
+		je(exit);
+
+		mov(rax, qword[rsp]);
+		sub(rax, BUDGET_REG);
+		add(qword[rsp + 16], rax);
+		mov(BUDGET_REG, qword[rsp]);
+		jmp(loop);
+
+		L(exit);
+		mov(PC_PTR, PC);
+		mov(I_REG_PTR, I_REG);
+
+		for (auto reg : PINNED_REGS)
+			mov(REG_PTR(reg), V_REG(reg));
+
+		mov(rax, qword[rsp]);
+		sub(rax, BUDGET_REG);
+		add(rax, qword[rsp + 16]);
+
+		add(rsp, 24);
+#ifdef _WIN32
+		pop(rsi);
+		pop(rdi);
+#endif
+		pop(r15);
+		pop(r14);
+		pop(r13);
+		pop(r12);
+		pop(rbp);
+		pop(rbx);
+		ret();
 
-		if (blockBranches > 0)
-			xor_(BRANCH_SKIP_REG, BRANCH_SKIP_REG);
+		dispatchExhausted = exhausted.getAddress();
+		dispatchExit = exit.getAddress();
+		dispatcherSize = getSize();
+	}
 
-		if (IregAllocated)
-		{
-			push(I_FULL_REG);
-			movzx(I_FULL_REG, I_REG_PTR);
-		}
+	Xbyak::util::Cpu cpuCaps;
+
+	CPUTier hostTier { CPUTier::Baseline };
+	CPUTier tier { CPUTier::Baseline };
+
+	inline void checkCPUSupport()
+	{
+		using Cpu = Xbyak::util::Cpu;
+		cpuCaps = Cpu();
+
+		if (cpuCaps.has(Cpu::tAVX512F) && cpuCaps.has(Cpu::tAVX2) && cpuCaps.has(Cpu::tBMI1) && cpuCaps.has(Cpu::tBMI2))
+			hostTier = CPUTier::AVX512;
+		else if (cpuCaps.has(Cpu::tAVX2) && cpuCaps.has(Cpu::tBMI1) && cpuCaps.has(Cpu::tBMI2))
+			hostTier = CPUTier::AVX2;
+		else if (cpuCaps.has(Cpu::tAVX))
+			hostTier = CPUTier::AVX;
+		else if (cpuCaps.has(Cpu::tSSE2))
+			hostTier = CPUTier::SSE2;
+
+		tier = hostTier;
+	}
+
+	inline bool hasTier(CPUTier required) const { return tier >= required; }
+
+	// baseline tier: the code of each instruction shape is emitted once into a stencil, blocks run for the first time
+	// are copied together from stencils with their operands patched into the holes, no emitting on the block miss.
+	enum class HoleKind : uint8_t
+	{
+		Imm8, // the operand
+		Imm16,
+		Imm32,
+		Counter, // disp32 of the operand's entry counter
+		Count, // imm32 of the instructions executed so far
+		Label, // rel32 of a skip, patched by copySkipLabel()
+		Dispatch, // rel32 to the dispatch loop
+		Exhausted, // rel32 to the exhausted path of the dispatcher
+		Address, // imm64 of a relocated address
+		Link // exit stub to the operand
+	};
+
+	struct StencilHole
+	{
+		uint16_t offset{};
+		HoleKind kind{};
+		CodeAddress address{};
+	};
+
+	struct Stencil
+	{
+		std::vector<uint8_t> code{};
+		std::vector<StencilHole> holes{};
+	};
 
-		for (int i = 0; i < allocatedRegs.size(); i++)
+	static constexpr int16_t NO_STENCIL = -1;
+
+	std::vector<Stencil> stencils{};
+	std::array<int16_t, 0x10000> opStencils{}; // by opcode, opcodes of the same shape share one
+	std::array<int16_t, 16> rowStencils{}; // DXYN rows by height, copied after the sprite position
+
+	int16_t entryStencil{ NO_STENCIL };
+	int16_t exitStencil{ NO_STENCIL };
+	int16_t notTakenStencil{ NO_STENCIL };
+	size_t entryOffset{ 0 }; // the entry stencil starts with its cold paths
+
+	// stencils bake in the quirks and CPU tier, they're rebuilt by clearCache() when either changed.
+	uint8_t stencilQuirks{ 0xFF };
+	CPUTier stencilTier{ CPUTier::Baseline };
+
+	std::vector<StencilHole> holes{};
+	size_t stencilStart{ 0 };
+
+	static constexpr size_t holeSize(HoleKind kind)
+	{
+		switch (kind)
 		{
-			push(V_FULL_REG(i));
-			mov(V_REG(allocatedRegs[i]), REG_PTR(allocatedRegs[i]));
+		case HoleKind::Imm8: return sizeof(uint8_t);
+		case HoleKind::Imm16: return sizeof(uint16_t);
+		case HoleKind::Address: return sizeof(uint64_t);
+		case HoleKind::Link: return 5;
+		default: return sizeof(uint32_t);
 		}
 	}
 
-	void emitEpilogue()
+	// the hole ends at the emit position.
+	inline void hole(HoleKind kind)
+	{
+		holes.push_back(StencilHole{ static_cast<uint16_t>(getSize() - holeSize(kind) - stencilStart), kind });
+	}
+
+	// emits body at the end of the cache and moves it into a stencil, its relocations become holes.
+	template <typename Func>
+	int16_t makeStencil(Func body)
+	{
+		align(4); // keeps the link jumps aligned in copies, see copyStencil()
+		stencilStart = getSize();
+		holes.clear();
+		body();
+
+		for (const auto& relocation : relocations)
+			holes.push_back(StencilHole{ static_cast<uint16_t>(relocation.offset - stencilStart), HoleKind::Address, relocation.target });
+
+		stencils.push_back(Stencil{ std::vector<uint8_t>(getCode() + stencilStart, getCurr()), holes });
+
+		setSize(stencilStart);
+		resetState();
+
+		return static_cast<int16_t>(stencils.size() - 1);
+	}
+
+	// opcodes sharing code up to their operands map to the same shape, invalid ones run as no-ops like 0NNN.
+	static uint16_t stencilShape(uint16_t opcode)
 	{
-		for (int i = allocatedRegs.size() - 1; i >= 0; i--)
+		const uint8_t n = opcode & 0x000F;
+
+		switch (opcode & 0xF000)
 		{
-			mov(REG_PTR(allocatedRegs[i]), V_REG(allocatedRegs[i]));
-			pop(V_FULL_REG(i));
+		case 0x0000:
+			return opcode == 0x00E0 || opcode == 0x00EE ? opcode : 0x0000;
+		case 0x1000:
+		case 0x2000:
+		case 0xA000:
+			return opcode & 0xF000;
+		case 0x3000:
+		case 0x4000:
+		case 0x6000:
+		case 0x7000:
+		case 0xB000:
+		case 0xC000:
+			return opcode & 0xFF00;
+		case 0x5000:
+		case 0x9000:
+			return n == 0 ? opcode : 0x0000;
+		case 0x8000:
+			return n <= 0x7 || n == 0xE ? opcode : 0x0000;
+		case 0xD000:
+			return n != 0 ? (opcode & 0xFFF0) | 1 : 0xD000;
+		case 0xE000:
+			return (opcode & 0x00FF) == 0x009E || (opcode & 0x00FF) == 0x00A1 ? opcode : 0x0000;
+		default:
+			switch (opcode & 0x00FF)
+			{
+			case 0x0007: case 0x000A: case 0x0015: case 0x0018: case 0x001E:
+			case 0x0029: case 0x0033: case 0x0055: case 0x0065:
+				return opcode;
+			default:
+				return 0x0000;
+			}
 		}
+	}
 
-		if (blockBranches > 0)
-			lea(rax, ptr[BRANCH_SKIP_REG + instructions - blockBranches]);
-		else
-			mov(rax, instructions);
+	// sub of the executed instructions, then to the dispatcher with PC already set.
+	inline void emitEpilogueStencil()
+	{
+		sub(BUDGET_REG, 0x7FFFFFFF);
+		hole(HoleKind::Count);
+		jmp(dispatchLoop, T_NEAR);
+		hole(HoleKind::Dispatch);
+	}
+
+	// a store in a baseline block ends it, the blocks it hit are invalidated and it leaves through its exit.
+	inline void emitStoreCheck(uint8_t length)
+	{
+		Xbyak::Label next;
+
+		testCodeLines(length);
+		jz(next, T_NEAR);
+
+		pushGuestState();
+		movzx(ARG1, I_REG);
+		lea(ARG2, ptr[ARG1 + length]);
+		mov(ARG3, 0xFFFF);
+		callFunc(CodeAddress::InvalidateBlocks);
+		popGuestState();
+
+		L(next);
+	}
 
-		if (IregAllocated)
+	inline void emitSkipStencil()
+	{
+		hole(HoleKind::Label);
+		L("@@");
+	}
+
+	void emitStencil(uint16_t opcode)
+	{
+		const uint8_t regX = (opcode & 0x0F00) >> 8;
+		const uint8_t regY = (opcode & 0x00F0) >> 4;
+
+		switch (opcode & 0xF000)
 		{
-			mov(I_REG_PTR, I_REG);
-			pop(I_FULL_REG);
+		case 0x0000:
+			if (opcode == 0x00E0)
+				emit00E0();
+			else if (opcode == 0x00EE)
+			{
+				dec(SP);
+				mov(cx, SP);
+				and_(rcx, 0xF);
+				mov(PC, STACK_PTR);
+				and_(PC, 0xFFF);
+				emitEpilogueStencil();
+			}
+			break;
+		case 0x2000: // the exit to NNN is copied after it
+			mov(cx, SP);
+			and_(rcx, 0xF);
+			mov(STACK_PTR, 0x7FFF);
+			hole(HoleKind::Imm16);
+			inc(SP);
+			break;
+		case 0x3000:
+			cmp(V_REG(regX), 0x7F);
+			hole(HoleKind::Imm8);
+			jumpSkip(true);
+			emitSkipStencil();
+			break;
+		case 0x4000:
+			cmp(V_REG(regX), 0x7F);
+			hole(HoleKind::Imm8);
+			jumpSkip(false);
+			emitSkipStencil();
+			break;
+		case 0x5000:
+			emit5XY0(regX, regY);
+			emitSkipStencil();
+			break;
+		case 0x6000:
+			mov(V_REG(regX), 0x7F);
+			hole(HoleKind::Imm8);
+			break;
+		case 0x7000:
+			add(V_REG(regX), 0x7F);
+			hole(HoleKind::Imm8);
+			break;
+		case 0x8000:
+			switch (opcode & 0x000F)
+			{
+			case 0x0000: emit8XY0(regX, regY); break;
+			case 0x0001: emit8XY1(regX, regY); break;
+			case 0x0002: emit8XY2(regX, regY); break;
+			case 0x0003: emit8XY3(regX, regY); break;
+			case 0x0004: emit8XY4(regX, regY); break;
+			case 0x0005: emit8XY5(regX, regY); break;
+			case 0x0006: emit8XY6(regX, regY); break;
+			case 0x0007: emit8XY7(regX, regY); break;
+			case 0x000E: emit8XYE(regX, regY); break;
+			}
+			break;
+		case 0x9000:
+			emit9XY0(regX, regY);
+			emitSkipStencil();
+			break;
+		case 0xA000:
+			mov(I_REG, 0x7FFF);
+			hole(HoleKind::Imm16);
+			break;
+		case 0xB000:
+			mov(PC, 0x7FFF);
+			hole(HoleKind::Imm16);
+			movzx(cx, Quirks::Jumping ? V_REG(regX) : V_REG(0));
+			add(PC, cx);
+			and_(PC, 0xFFF);
+			emitEpilogueStencil();
+			break;
+		case 0xC000:
+			rdtsc();
+			and_(eax, 0x7FFFFFFF);
+			hole(HoleKind::Imm32);
+			mov(V_REG(regX), al);
+			break;
+		case 0xD000:
+			if (opcode & 0x000F)
+				emitSpritePosition(regX, regY);
+			else
+				emitDXYN(regX, regY, 0);
+			break;
+		case 0xE000:
+			if ((opcode & 0x00FF) == 0x009E)
+				emitEX9E(regX);
+			else
+				emitEXA1(regX);
+
+			emitSkipStencil();
+			break;
+		case 0xF000:
+			switch (opcode & 0x00FF)
+			{
+			case 0x0007: emitFX07(regX); break;
+			case 0x0015: emitFX15(regX); break;
+			case 0x0018: emitFX18(regX); break;
+			case 0x001E: emitFX1E(regX); break;
+			case 0x0029: emitFX29(regX); break;
+			case 0x0033:
+				storeBCD(regX);
+				emitStoreCheck(2);
+				break;
+			case 0x0055:
+				store<true>(regX);
+				emitStoreCheck(regX);
+				emitMemoryIncrement(regX);
+				break;
+			case 0x0065: emitFX65(regX); break;
+			}
+			break;
 		}
+	}
 
-		ret();
+	// the exit to the operand: through the stub while there's budget left, through the dispatcher otherwise.
+	inline void emitExitStencil()
+	{
+		Xbyak::Label fallback;
 
-		resetState();
+		sub(BUDGET_REG, 0x7FFFFFFF);
+		hole(HoleKind::Count);
+		jle(fallback);
+
+		emitLinkJump();
+		hole(HoleKind::Link);
+
+		L(fallback);
+		mov(PC, 0x7FFF);
+		hole(HoleKind::Imm16);
+		jmp(dispatchLoop, T_NEAR);
+		hole(HoleKind::Dispatch);
 	}
 
-	FORCE_INLINE uint64_t execute(uint32_t offset) const
+	// the budget check and the entry counter, once it runs out the block is recompiled by the emitter.
+	inline void emitEntryStencil()
 	{
-		return reinterpret_cast<uint16_t(*)()>(const_cast<uint8_t*>(getCode()) + offset)();
+		Xbyak::Label exhausted, warm;
+
+		L(exhausted);
+		mov(PC, 0x7FFF);
+		hole(HoleKind::Imm16);
+		jmp(dispatchExhausted, T_NEAR);
+		hole(HoleKind::Exhausted);
+
+		L(warm);
+		mov(PC, 0x7FFF);
+		hole(HoleKind::Imm16);
+		pushGuestState();
+		movzx(ARG1.cvt32(), PC);
+		callFunc(CodeAddress::TierUpBlock);
+		popGuestState();
+		jmp(dispatchLoop, T_NEAR);
+		hole(HoleKind::Dispatch);
+
+		entryOffset = getSize() - stencilStart;
+
+		cmp(BUDGET_REG, 0x7FFFFFFF);
+		hole(HoleKind::Count);
+		jl(exhausted, T_NEAR);
+
+		movAddress(rax, CodeAddress::EntryCounters);
+		dec(dword[rax + 0x7FFFFFF0]);
+		hole(HoleKind::Counter);
+		jz(warm, T_NEAR);
 	}
 
-	inline void emit00E0()
+	// a baseline block whose entry counter ran out. it's dropped and compiled by the emitter on its next miss.
+	static void tierUpBlock(uint16_t pc)
 	{
-		lea(rcx, ptr[BASE + offsetof(ChipState, screenBuffer)]);
+		std::lock_guard lock{ JIT.mutex };
 
-		if (AVXSupport)
-		{
-			vxorpd(ymm0, ymm0, ymm0);
+		JIT.warmBlocks[pc] = 1;
+		JIT.entryCounters[pc] = ChipJITState::HOT_ENTRIES; // profiled from the start
+		dropBlock(JIT.blockMap[pc].block);
+	}
 
-			for (int i = 0; i < 32; i += 4)
-				vmovdqu(ptr[rcx + i * 8], ymm0);
+	template <typename T>
+	static inline void patch(uint8_t* field, T value)
+	{
+		std::memcpy(field, &value, sizeof(value));
+	}
 
-			vzeroupper();
-		}
-		else if (SSE2Support)
+	static inline void patchRel(uint8_t* field, const uint8_t* target)
+	{
+		patch(field, static_cast<int32_t>(target - (field + sizeof(int32_t))));
+	}
+
+	void copyStencil(const Stencil& stencil, uint16_t operand)
+	{
+		if (std::any_of(stencil.holes.begin(), stencil.holes.end(), [](const StencilHole& hole) { return hole.kind == HoleKind::Link; }))
+			align(4);
+
+		const size_t at = getSize();
+		uint8_t* code = const_cast<uint8_t*>(getCurr());
+
+		std::memcpy(code, stencil.code.data(), stencil.code.size());
+		setSize(at + stencil.code.size());
+
+		for (const auto& stencilHole : stencil.holes)
 		{
-			pxor(xmm0, xmm0);
+			uint8_t* field = code + stencilHole.offset;
 
-			for (int i = 0; i < 32; i += 2)
-				movdqu(ptr[rcx + i * 8], xmm0);
+			switch (stencilHole.kind)
+			{
+			case HoleKind::Imm8: patch(field, static_cast<uint8_t>(operand)); break;
+			case HoleKind::Imm16: patch(field, operand); break;
+			case HoleKind::Imm32: patch(field, static_cast<uint32_t>(operand)); break;
+			case HoleKind::Counter: patch(field, static_cast<uint32_t>(operand * sizeof(uint32_t))); break;
+			case HoleKind::Count: patch(field, static_cast<uint32_t>(executed())); break;
+			case HoleKind::Label: break;
+			case HoleKind::Dispatch: patchRel(field, dispatchLoop); break;
+			case HoleKind::Exhausted: patchRel(field, dispatchExhausted); break;
+			case HoleKind::Address:
+				relocations.push_back(CodeRelocation{ static_cast<uint32_t>(at + stencilHole.offset), stencilHole.address });
+				break;
+			case HoleKind::Link:
+				exitStubs.push_back(ExitStub{ operand, field });
+				exitPCs.push_back(operand);
+				break;
+			}
 		}
-		else
+	}
+
+	// the operand patched into the holes of the instruction's stencil.
+	static uint16_t stencilOperand(uint16_t pc, uint16_t opcode)
+	{
+		switch (opcode & 0xF000)
 		{
-			for (int i = 0; i < 32; i++)
-				mov(qword[rcx + i * 8], 0);
+		case 0x1000:
+		case 0xA000:
+		case 0xB000:
+			return opcode & 0xFFF;
+		case 0x2000:
+			return (pc + 2) & 0xFFF;
+		case 0x3000:
+		case 0x4000:
+		case 0x6000:
+		case 0x7000:
+		case 0xC000:
+			return opcode & 0xFF;
+		default:
+			return 0;
 		}
 	}
 
-	inline const uint8_t* getCodePtr() const { return getCode(); }
-	inline size_t getCodeSize() const { return getSize(); }
+public:
+	static constexpr uint32_t MAX_CACHE_SIZE = 4 * 1048576;
 
-	inline void clearCache() { resetSize(); }
+	// part of the key of cached code on disk, bump it whenever the emitted code changes.
+	static constexpr uint32_t CODE_VERSION = 9;
 
-	void emitJumpLabel()
-	{		
-		L("@@");
-	}
+	uint64_t instructions { 0 };
 
-	inline void emit00EE()
-	{
-		dec(SP);
-		mov(cx, SP);
-		and_(rcx, 0xF);
-		mov(cx, STACK_PTR);
-		mov(PC, cx);
+	// counted copies of a block check the budget before every instruction, the dispatcher enters them
+	// when the budget can't cover the whole block.
+	bool counted { false };
+
+	// set while emitting an instruction whose VF result is overwritten before anything reads it.
+	bool flagDead { false };
+
+	// set once the block has stored to RAM, a 16-byte FX65 load over those bytes would miss store forwarding.
+	bool ramStored { false };
+
+	// blocks compiled with profiling count their entries and the outcomes of the skips ending them.
+	bool profiling { false };
+
+	// the skip being emitted jumps to "@f" when it isn't taken, the block falls through to the taken exit.
+	bool invertSkip { false };
+
+	// guest code and sprite data are read from here while compiling, a snapshot of RAM when the compiler thread runs.
+	const uint8_t* codeRAM { s.RAM.data() };
+
+	inline void resetState()
+	{
+		for (int i = 0; i < 16; i++)
+		{
+			if (!(PINNED_MASK & (1 << i)))
+				heldRegs[i] = nullptr;
+		}
+
+		intervals.clear();
+		carriedRegs = 0;
+		loopCheckOffsets.clear();
+		dataRanges.clear();
+		exitPCs.clear();
+		exitStubs.clear();
+		pendingCaches.clear();
+		relocations.clear();
+		coldPaths.clear();
+		forgetKnown();
+		ramStored = false;
+		instructions = 0;
+		blockBranches = 0;
+	}
+
+#if defined(__linux__)
+	static inline HugePageAllocator cacheAllocator{};
+	ChipEmitter(size_t compileFunc, const void* compileArg) : Xbyak::CodeGenerator(MAX_CACHE_SIZE, nullptr, &cacheAllocator)
+#else
+	ChipEmitter(size_t compileFunc, const void* compileArg) : Xbyak::CodeGenerator(MAX_CACHE_SIZE)
+#endif
+	{
+		heldRegs[0xF] = &bl;
+		heldRegs[0x0] = &bpl;
+		heldRegs[0x1] = &r12b;
+		heldRegs[0x2] = &r13b;
+		heldRegs[0x3] = &r14b;
+		forgetKnown();
+
+		checkCPUSupport();
+		emitDispatcher(compileFunc, compileArg);
+	}
+
+	// linear scan over the decoded block. V registers accessed at least twice get a caller-saved host register
+	// for their live range, the longest-living interval is spilled when none is free. in a block jumping back to
+	// its own start the most accessed ones are carried around the loop instead: held over the whole block, they're
+	// loaded once before the loop head.
+	void allocateRegs(const std::vector<DecodedInstr>& block)
+	{
+		const uint16_t startPC = block.front().pc & 0xFFF;
+		const bool loops = !counted && !profiling && std::any_of(block.begin(), block.end(), [=](const DecodedInstr& instr) {
+			return (instr.opcode & 0xF000) == 0x1000 && (instr.opcode & 0xFFF) == startPC;
+		});
+
+		// r8 and r9 are scratch registers of DXYN and FX33.
+		const bool scratchUsed = std::any_of(block.begin(), block.end(), [](const DecodedInstr& instr) {
+			return (instr.opcode & 0xF000) == 0xD000 || (instr.opcode & 0xF0FF) == 0xF033;
+		});
+
+		std::vector<const Xbyak::Reg8*> freeRegs{ &dil };
+		if (!scratchUsed)
+		{
+			freeRegs.push_back(&r8b);
+			freeRegs.push_back(&r9b);
+		}
+
+		for (uint8_t reg = 0; reg < 16; reg++)
+		{
+			if (PINNED_MASK & (1 << reg))
+				continue;
+
+			LiveInterval interval{ reg };
+
+			for (size_t i = 0; i < block.size(); i++)
+			{
+				if (!((block[i].uses | block[i].defs) & (1 << reg)))
+					continue;
+
+				if (interval.accesses++ == 0)
+				{
+					interval.start = i;
+					interval.load = block[i].uses & (1 << reg);
+				}
+
+				interval.end = i;
+			}
+
+			if (interval.accesses < 2)
+				continue;
+
+			// a skipped instruction may not run: load before the skip, write back after the skip label.
+			if (interval.start > 0 && block[interval.start - 1].flow == Flow::Skip)
+			{
+				interval.start--;
+				interval.load = true;
+			}
+			if (block[interval.end].flow == Flow::Skip)
+				interval.end++;
+
+			intervals.push_back(interval);
+		}
+
+		if (loops)
+		{
+			std::sort(intervals.begin(), intervals.end(), [](const LiveInterval& a, const LiveInterval& b) { return a.accesses > b.accesses; });
+
+			for (size_t i = 0; i < intervals.size() && !freeRegs.empty(); i++)
+			{
+				intervals[i] = LiveInterval{ intervals[i].reg, 0, block.size() - 1, true, freeRegs.back(), intervals[i].accesses };
+				carriedRegs |= 1 << intervals[i].reg;
+				freeRegs.pop_back();
+			}
+		}
+
+		std::sort(intervals.begin(), intervals.end(), [](const LiveInterval& a, const LiveInterval& b) { return a.start < b.start; });
+
+		std::vector<LiveInterval*> active{};
+
+		for (auto& interval : intervals)
+		{
+			if (interval.host != nullptr) continue; // carried around the loop, never spilled
+
+			std::erase_if(active, [&](LiveInterval* other) {
+				if (other->end >= interval.start) return false;
+				freeRegs.push_back(other->host);
+				return true;
+			});
+
+			if (!freeRegs.empty())
+			{
+				interval.host = freeRegs.back();
+				freeRegs.pop_back();
+				active.push_back(&interval);
+				continue;
+			}
+
+			if (active.empty()) continue; // all carried
+
+			auto victim = std::max_element(active.begin(), active.end(), [](LiveInterval* a, LiveInterval* b) { return a->end < b->end; });
+
+			if ((*victim)->end > interval.end && (*victim)->start < interval.start)
+			{
+				interval.host = (*victim)->host;
+				(*victim)->end = interval.start - 1; // the rest of it uses memory
+				*victim = &interval;
+			}
+		}
+
+		std::erase_if(intervals, [](const LiveInterval& interval) { return interval.host == nullptr; });
+	}
+
+	// loads the intervals starting at decoded instruction i.
+	void beginInstr(size_t i)
+	{
+		for (const auto& interval : intervals)
+		{
+			if (interval.start != i) continue;
+
+			heldRegs[interval.reg] = interval.host;
+			dirtyRegs[interval.reg] = false;
+
+			if (interval.load)
+				mov(*interval.host, REG_PTR(interval.reg));
+		}
+
+		if (i != 0) return;
+
+		// the values carried around the loop may differ from memory after the first iteration.
+		loopHead = getCurr();
+		for (int reg = 0; reg < 16; reg++)
+		{
+			if (carriedRegs & (1 << reg))
+				dirtyRegs[reg] = true;
+		}
+	}
+
+	// marks the registers written by instruction i and frees the intervals ending there.
+	void endInstr(size_t i, uint16_t defs)
+	{
+		for (int reg = 0; reg < 16; reg++)
+		{
+			if ((defs & (1 << reg)) && heldRegs[reg] != nullptr)
+				dirtyRegs[reg] = true;
+		}
+
+		for (const auto& interval : intervals)
+		{
+			if (interval.end != i) continue;
+
+			if (dirtyRegs[interval.reg])
+				mov(REG_PTR(interval.reg), *interval.host);
+
+			heldRegs[interval.reg] = nullptr;
+		}
+	}
+
+	// stores the dirty allocated registers before the block is left, they stay allocated.
+	void emitWriteBack(bool clean = true, uint16_t kept = 0)
+	{
+		for (int reg = 0; reg < 16; reg++)
+		{
+			if (((PINNED_MASK | kept) & (1 << reg)) || heldRegs[reg] == nullptr || !dirtyRegs[reg])
+				continue;
+
+			mov(REG_PTR(reg), *heldRegs[reg]);
+			if (clean) dirtyRegs[reg] = false;
+		}
+	}
+
+	// a block only runs if the budget covers all of its instructions, the count is patched in by finishBlock().
+	void emitBlockEntry(uint16_t startPC)
+	{
+		blockStartPC = startPC & 0xFFF;
+		if (counted) return;
+
+		Xbyak::Label exhausted;
+
+		blockEntry = getCurr();
+		loopHead = blockEntry;
+
+		cmp(BUDGET_REG, 0x7FFFFFFF); // imm32 placeholder
+		budgetCheckOffset = getSize() - sizeof(uint32_t);
+		jl(exhausted, T_NEAR);
+
+		emitCold(exhausted, [this, startPC] {
+			mov(PC, startPC & 0xFFF);
+			jmp(dispatchExhausted);
+		});
+
+		if (!profiling) return;
+
+		Xbyak::Label hot;
+
+		movAddress(rax, CodeAddress::EntryCounters);
+		sub(dword[rax + static_cast<int>(blockStartPC * sizeof(uint32_t))], 1);
+		jz(hot, T_NEAR);
+
+		emitCold(hot, [this] {
+			mov(PC, blockStartPC);
+			pushGuestState();
+			mov(ARG1, blockStartPC);
+			callFunc(CodeAddress::PromoteBlock);
+			popGuestState();
+			jmp(dispatchLoop);
+		});
+	}
+
+	inline void finishBlock()
+	{
+		if (!counted)
+			rewrite(budgetCheckOffset, instructions, sizeof(uint32_t));
+
+		for (size_t offset : loopCheckOffsets)
+			rewrite(offset, instructions, sizeof(uint32_t));
+
+		const size_t hotExits = exitPCs.size();
+
+		for (auto& path : coldPaths)
+		{
+			heldRegs = path.heldRegs;
+			dirtyRegs = path.dirtyRegs;
+			instructions = path.instructions;
+			blockBranches = path.blockBranches;
+
+			L(path.entry);
+			path.body();
+		}
+
+		exitPCs.resize(hotExits); // only taken after the block was invalidated
+	}
+
+	// block entries start on a 32-byte boundary, the fetch and uop cache lines of the entry aren't shared with
+	// the tail of the previous block.
+	static constexpr size_t BLOCK_ALIGNMENT = 32;
+
+	inline void alignBlock()
+	{
+		align(BLOCK_ALIGNMENT);
+	}
+
+	void emitBudgetCheck(uint16_t pc)
+	{
+		if (!counted || instructions == 0) return;
+
+		Xbyak::Label next;
+
+		cmp(BUDGET_REG, instructions - blockBranches);
+		jg(next);
+		emitWriteBack(false);
+		sub(BUDGET_REG, instructions - blockBranches);
+		mov(PC, pc & 0xFFF);
+		jmp(dispatchExhausted);
+		L(next);
+	}
+
+	// exit for blocks whose next PC is computed at runtime (PC must already be set).
+	void emitEpilogue()
+	{
+		sub(BUDGET_REG, instructions - blockBranches);
+		jmp(dispatchLoop);
+	}
+
+	// instructions executed on the straight path through the block so far.
+	inline uint64_t executed() const { return instructions - blockBranches; }
+
+	inline void emitLinkedEpilogue(uint16_t targetPC)
+	{
+		emitLinkedEpilogue(targetPC, executed());
+	}
+
+	// exit for blocks with a statically known successor, it writes back the allocated registers. while there is
+	// budget left, the exit stub jumps straight into the successor's code once it is compiled, otherwise it goes
+	// through the dispatcher.
+	// mayLoop is false after a store that can invalidate the block itself, its stub gets unlinked then.
+	void emitLinkedEpilogue(uint16_t targetPC, uint64_t executed, bool mayLoop = true)
+	{
+		Xbyak::Label exit;
+		targetPC &= 0xFFF;
+
+		// back-edge to the block's own start, loop natively. profiled blocks go through the entry for its counter.
+		if (mayLoop && !counted && targetPC == blockStartPC)
+		{
+			Xbyak::Label loop;
+			sub(BUDGET_REG, executed);
+
+			if (profiling)
+			{
+				emitWriteBack(false);
+				jmp(blockEntry, T_NEAR);
+				return;
+			}
+
+			// the entry's budget check is repeated and the loop continues past the loads of the first instruction.
+			// the carried registers keep their values, the other intervals of the first instruction are loaded again.
+			cmp(BUDGET_REG, 0x7FFFFFFF); // imm32 placeholder
+			loopCheckOffsets.push_back(getSize() - sizeof(uint32_t));
+			jge(loop);
+			emitWriteBack(false);
+			jmp(blockEntry, T_NEAR); // fails the entry check too
+
+			L(loop);
+			emitWriteBack(false, carriedRegs);
+
+			for (const auto& interval : intervals)
+			{
+				if (interval.start == 0 && interval.load && heldRegs[interval.reg] != interval.host)
+					mov(*interval.host, REG_PTR(interval.reg));
+			}
+
+			jmp(loopHead, T_NEAR);
+			return;
+		}
+
+		emitWriteBack(false);
+		sub(BUDGET_REG, executed);
+		jle(exit);
+		emitExitStub(targetPC, exit);
+	}
+
+	// jmp rel32 to the block at targetPC once it's compiled, until then it falls through to the dispatcher.
+	void emitExitStub(uint16_t targetPC, Xbyak::Label& fallback)
+	{
+		uint8_t* stub = emitLinkJump();
+
+		L(fallback);
+		mov(PC, targetPC);
+		jmp(dispatchLoop);
+
+		exitStubs.push_back(ExitStub{ targetPC, stub });
+		exitPCs.push_back(targetPC);
+	}
+
+	// a jmp rel32 to the next instruction, linked by linkExit(). the compiler thread links stubs while compiled code
+	// runs, so the displacement is 4-byte aligned: patching it is a single store the running code sees whole.
+	inline uint8_t* emitLinkJump()
+	{
+		nop(3 - getSize() % 4);
+
+		uint8_t* stub = const_cast<uint8_t*>(getCurr());
+		db(0xE9); dd(0);
+
+		return stub;
+	}
+
+	// registers the relocations, inline caches and exit stubs of the block emitted last, which is blocks[index].
+	// called with JIT.mutex held, before the block's entry is published.
+	void publishBlock(int16_t index)
+	{
+		JIT.relocations.insert(JIT.relocations.end(), relocations.begin(), relocations.end());
+
+		for (auto& pending : pendingCaches)
+		{
+			pending.cache.block = index;
+			rewrite(pending.indexOffset, JIT.addInlineCache(pending.cache), sizeof(uint32_t));
+		}
+
+		for (const auto& exit : exitStubs)
+		{
+			JIT.blockLinks[exit.pc].push_back(exit.stub);
+
+			if (JIT.blockEntries[exit.pc] != nullptr)
+				linkExit(exit.stub, JIT.blockEntries[exit.pc]);
+		}
+	}
+
+	inline void linkBlock(uint16_t pc, const uint8_t* code)
+	{
+		for (auto stub : JIT.blockLinks[pc])
+			linkExit(stub, code);
+	}
+
+	// points the stubs jumping to pc at its block, or back to the dispatcher without one. used after the links
+	// were restored from a cache file.
+	static void relinkBlock(uint16_t pc)
+	{
+		if (JIT.blockEntries[pc] == nullptr)
+		{
+			unlinkBlock(pc);
+			return;
+		}
+
+		for (auto stub : JIT.blockLinks[pc])
+			linkExit(stub, JIT.blockEntries[pc]);
+	}
+
+	// the block's code stays in the cache until its region is reused, exits into it go back through the dispatcher.
+	static void dropBlock(int16_t index)
+	{
+		const uint16_t pc = JIT.blocks[index].startPC;
+
+		JIT.storeEntry(pc, nullptr);
+		JIT.countedEntries[pc] = nullptr;
+		JIT.removeBlockLines(index);
+		JIT.freeInlineCaches(index);
+		unlinkBlock(pc);
+	}
+
+	// drops the blocks compiled from [startAddr, endAddr], for stores that weren't made by compiled code.
+	static inline void invalidateWrite(uint16_t startAddr, uint16_t endAddr)
+	{
+		invalidateBlocks(startAddr, endAddr, 0xFFFF);
+	}
+
+	// enters the dispatcher at the current PC (or at entry), returns the number of executed instructions.
+	FORCE_INLINE uint64_t execute(int64_t budget, const volatile bool* running = nullptr, const uint8_t* entry = nullptr) const
+	{
+		using Dispatcher = uint64_t(*)(int64_t, const volatile bool*, const uint8_t*);
+		return reinterpret_cast<Dispatcher>(const_cast<uint8_t*>(getCode()))(budget, running, entry);
+	}
+
+	inline void emit00E0()
+	{
+		lea(rcx, ptr[BASE + offsetof(ChipState, screenBuffer)]);
+
+		if (hasTier(CPUTier::AVX512))
+		{
+			vpxord(zmm0, zmm0, zmm0);
+
+			for (int i = 0; i < 32; i += 8)
+				vmovdqu64(ptr[rcx + i * 8], zmm0);
+
+			vzeroupper();
+		}
+		else if (hasTier(CPUTier::AVX))
+		{
+			vxorpd(ymm0, ymm0, ymm0);
+
+			for (int i = 0; i < 32; i += 4)
+				vmovdqu(ptr[rcx + i * 8], ymm0);
+
+			vzeroupper();
+		}
+		else if (hasTier(CPUTier::SSE2))
+		{
+			pxor(xmm0, xmm0);
+
+			for (int i = 0; i < 32; i += 2)
+				movdqu(ptr[rcx + i * 8], xmm0);
+		}
+		else
+		{
+			for (int i = 0; i < 32; i++)
+				mov(qword[rcx + i * 8], 0);
+		}
+	}
+
+	inline CPUTier getHostTier() const { return hostTier; }
+	inline CPUTier getTier() const { return tier; }
+
+	// code already in the cache keeps its tier, the cache must be cleared after this.
+	inline void setTier(CPUTier requested)
+	{
+		tier = std::min(requested, hostTier);
+	}
+
+	inline const uint8_t* getCodePtr() const { return getCode(); }
+	inline size_t getCodeSize() const { return getSize(); }
+	inline const std::vector<JITRange>& getDataRanges() const { return dataRanges; }
+	inline const std::vector<uint16_t>& getExitPCs() const { return exitPCs; }
+
+	inline size_t getDispatcherSize() const { return dispatcherSize; }
+	inline size_t getDispatchLoopOffset() const { return dispatchLoop - getCode(); }
+	inline size_t getDispatchExhaustedOffset() const { return dispatchExhausted - getCode(); }
+
+	// returned on a block miss, leaves the dispatcher with the guest state written back.
+	inline const uint8_t* getDispatchExit() const { return dispatchExit; }
+
+	// places code saved from another process after the dispatcher and patches in this process' addresses.
+	// blocks jump into the dispatcher with relative offsets, its layout has to match the one the code was saved with.
+	void restoreCode(const std::vector<uint8_t>& code)
+	{
+		uint8_t* top = const_cast<uint8_t*>(getCode());
+
+		std::memcpy(top + dispatcherSize, code.data(), code.size());
+		setSize(dispatcherSize + code.size());
+
+		for (const auto& relocation : JIT.relocations)
+		{
+			const uint64_t address = addressOf(relocation.target);
+			std::memcpy(top + relocation.offset, &address, sizeof(address));
+		}
+	}
+
+	// moves the emit position, code is compiled at the start of a reused cache region.
+	inline void setCodeSize(size_t size)
+	{
+		setSize(size);
+	}
+
+	inline void clearCache()
+	{
+		setSize(dispatcherSize);
+
+		if (!hasStencils())
+			buildStencils();
+	}
+
+	inline bool hasStencils() const { return stencilQuirks == Quirks::Pack() && stencilTier == tier; }
+	inline bool hasStencil(uint16_t opcode) const { return opStencils[opcode] != NO_STENCIL; }
+
+	// emitted at the end of the cache, which is empty at this point. FX0A has no stencil, its blocks are emitted.
+	void buildStencils()
+	{
+		stencils.clear();
+		opStencils.fill(NO_STENCIL);
+
+		entryStencil = makeStencil([this] { emitEntryStencil(); });
+		exitStencil = makeStencil([this] { emitExitStencil(); });
+		notTakenStencil = makeStencil([this] { dec(BUDGET_REG); });
+
+		for (int height = 1; height < 16; height++)
+			rowStencils[height] = makeStencil([this, height] { emitSpriteRows(height); });
+
+		for (int opcode = 0; opcode <= 0xFFFF; opcode++)
+		{
+			const uint16_t shape = stencilShape(opcode);
+
+			if (shape == 0x1000)
+				opStencils[opcode] = exitStencil;
+			else if ((shape & 0xF0FF) == 0xF00A)
+				continue;
+			else if (shape != opcode)
+				opStencils[opcode] = opStencils[shape];
+			else
+				opStencils[opcode] = makeStencil([this, shape] { emitStencil(shape); });
+		}
+
+		stencilQuirks = Quirks::Pack();
+		stencilTier = tier;
+	}
+
+	// block entry of a baseline block at startPC, returns the offset its guest code starts at. the budget check is
+	// patched by finishBlock() like in emitted blocks.
+	size_t copyEntry(uint16_t startPC)
+	{
+		const Stencil& entry = stencils[entryStencil];
+		nop((BLOCK_ALIGNMENT - (getSize() + entryOffset) % BLOCK_ALIGNMENT) % BLOCK_ALIGNMENT); // aligns the entry, not the cold paths before it
+
+		const size_t at = getSize();
+		copyStencil(entry, startPC & 0xFFF);
+
+		for (const auto& stencilHole : entry.holes)
+		{
+			if (stencilHole.kind == HoleKind::Count)
+				budgetCheckOffset = at + stencilHole.offset;
+		}
+
+		return at + entryOffset;
+	}
+
+	// returns the offset the instruction's code starts at. calls and sprites are copied from two stencils.
+	size_t copyInstr(uint16_t pc, uint16_t opcode)
+	{
+		const size_t at = getSize();
+		copyStencil(stencils[opStencils[opcode]], stencilOperand(pc, opcode));
+
+		if ((opcode & 0xF000) == 0x2000)
+			copyExit(opcode & 0xFFF);
+		else if ((opcode & 0xF000) == 0xD000 && (opcode & 0x000F) != 0)
+			copyStencil(stencils[rowStencils[opcode & 0x000F]], 0);
+
+		return at;
+	}
+
+	inline void copyExit(uint16_t targetPC)
+	{
+		copyStencil(stencils[exitStencil], targetPC & 0xFFF);
+	}
+
+	inline void copySkipNotTaken()
+	{
+		copyStencil(stencils[notTakenStencil], 0);
+		blockBranches++;
+	}
+
+	// points the skip copied at offset at to the emit position.
+	void copySkipLabel(size_t at, uint16_t opcode)
+	{
+		uint8_t* code = const_cast<uint8_t*>(getCode()) + at;
+
+		for (const auto& stencilHole : stencils[opStencils[opcode]].holes)
+		{
+			if (stencilHole.kind == HoleKind::Label)
+				patchRel(code + stencilHole.offset, getCurr());
+		}
+	}
+
+
+	void emitJumpLabel()
+	{		
+		L("@@");
+
+		for (int i = 0; i < 16; i++)
+		{
+			if (knownRegs[i] != skipKnownRegs[i])
+				knownRegs[i] = UNKNOWN;
+		}
+		if (knownI != skipKnownI)
+			knownI = UNKNOWN;
+	}
+
+	// outcome of a skip decided at compile time: 1 taken, 0 not taken, -1 when it depends on runtime state.
+	int knownSkip(uint16_t opcode) const
+	{
+		const uint8_t regX = (opcode & 0x0F00) >> 8;
+		const uint8_t regY = (opcode & 0x00F0) >> 4;
+		const uint8_t val = opcode & 0x00FF;
+
+		switch (opcode & 0xF000)
+		{
+		case 0x3000: return isKnown(regX) ? knownRegs[regX] == val : -1;
+		case 0x4000: return isKnown(regX) ? knownRegs[regX] != val : -1;
+		case 0x5000: return isKnown(regX) && isKnown(regY) ? knownRegs[regX] == knownRegs[regY] : -1;
+		case 0x9000: return isKnown(regX) && isKnown(regY) ? knownRegs[regX] != knownRegs[regY] : -1;
+		default: return -1;
+		}
+	}
+
+	// returns jump to the exit stub of the call site if the shadow stack predicted the popped PC.
+	inline void emit00EE()
+	{
+		dec(SP);
+		mov(cx, SP);
+		and_(rcx, 0xF);
+		mov(PC, STACK_PTR);
+		and_(PC, 0xFFF); // the interpreter pushes PC + 2 unmasked
+
+		sub(BUDGET_REG, executed());
+		jle(dispatchLoop);
+
+		movAddress(rax, CodeAddress::ShadowStack);
+		shl(ecx, 4);
+		cmp(PC, word[rax + rcx + offsetof(ShadowReturn, pc)]);
+		jne(dispatchLoop);
+		jmp(qword[rax + rcx + offsetof(ShadowReturn, code)]);
+	}
+
+	inline void emit1NNN(uint16_t addr)
+	{
+		emitLinkedEpilogue(addr);
+	}
+
+	inline void emitPushReturn(uint16_t returnPC)
+	{
+		mov(cx, SP);
+		and_(rcx, 0xF);
+		mov(STACK_PTR, returnPC & 0xFFF);
+		inc(SP);
+	}
+
+	inline void emitPopReturn()
+	{
+		dec(SP);
+	}
+
+	inline void emit2NNN(uint16_t addr, uint16_t returnPC)
+	{
+		Xbyak::Label returnStub, returnFallback;
+
+		emitPushReturn(returnPC);
+
+		static_assert(sizeof(ShadowReturn) == 16);
+		movAddress(rax, CodeAddress::ShadowStack);
+		shl(ecx, 4);
+		mov(word[rax + rcx + offsetof(ShadowReturn, pc)], returnPC & 0xFFF);
+		lea(rdx, ptr[rip + returnStub]);
+		mov(qword[rax + rcx + offsetof(ShadowReturn, code)], rdx);
+
+		emitLinkedEpilogue(addr);
+
+		L(returnStub);
+		emitExitStub(returnPC & 0xFFF, returnFallback);
+	}
+
+	// skips jump to "@f" when taken. inside a block the label follows the skipped instruction,
+	// for a skip that ends the block it's the taken exit.
+	inline void emitSkipNotTaken()
+	{
+		dec(BUDGET_REG);
+		blockBranches++;
+
+		skipKnownRegs = knownRegs;
+		skipKnownI = knownI;
 	}
 
-	inline void emit1NNN(uint16_t addr)
+	inline void emitSkipTaken(uint16_t targetPC, uint64_t executed, uint16_t skipPC)
 	{
-		mov(PC, addr & 0xFFF);
+		L("@@");
+		emitSkipCount(skipPC, true);
+		emitLinkedEpilogue(targetPC, executed);
 	}
 
-	inline void emit2NNN(uint16_t addr)
+	// the exit for the skip not being taken, after the taken one with invertSkip.
+	inline void emitSkipLabel()
 	{
-		mov(cx, SP);
-		and_(rcx, 0xF);
-		mov(ax, PC);
-		mov(STACK_PTR, ax);
-		mov(PC, addr & 0xFFF);
-		inc(SP);
+		L("@@");
 	}
 
-	template<bool jumpLabel>
-	inline void emit5XY0(uint8_t regX, uint8_t regY)
+	inline void emitSkipCount(uint16_t skipPC, bool taken)
 	{
-		if constexpr (!jumpLabel)
-			xor_(cx, cx);
+		if (!profiling) return;
 
-		CMP(V_REG(regX), V_REG(regY));
+		movAddress(rax, CodeAddress::SkipBias);
+		const auto counter = dword[rax + static_cast<int>((skipPC & 0xFFF) * sizeof(int32_t))];
 
-		if constexpr (jumpLabel)
-		{
+		if (taken)
+			add(counter, 1);
+		else
+			sub(counter, 1);
+	}
+
+	// jumps to "@f" when the skip is taken, and when it isn't with invertSkip.
+	inline void jumpSkip(bool takenIfZero)
+	{
+		if (takenIfZero != invertSkip)
 			jz("@f", T_NEAR);
-			inc(BRANCH_SKIP_REG);
-		}
 		else
-		{
-			setz(cl);
-			shl(cl, 1);
-			add(PC, cx);
-		}
+			jnz("@f", T_NEAR);
+	}
+
+	inline void emit5XY0(uint8_t regX, uint8_t regY)
+	{
+		CMP(V_REG(regX), V_REG(regY));
+		jumpSkip(true);
 	}
-	template<bool jumpLabel>
 	inline void emit9XY0(uint8_t regX, uint8_t regY)
 	{
-		if constexpr (!jumpLabel)
-			xor_(cx, cx);
-
 		CMP(V_REG(regX), V_REG(regY));
-
-		if constexpr (jumpLabel)
-		{
-			jnz("@f", T_NEAR);
-			inc(BRANCH_SKIP_REG);
-		}
-		else
-		{
-			setnz(cl);
-			shl(cl, 1);
-			add(PC, cx);
-		}
+		jumpSkip(false);
 	}
-	template<bool jumpLabel>
 	inline void emit3XNN(uint8_t regX, uint8_t val)
 	{
-		if constexpr (!jumpLabel)
-			xor_(cx, cx);
-
 		cmp(V_REG(regX), val);
-
-		if constexpr (jumpLabel)
-		{
-			jz("@f", T_NEAR);
-			inc(BRANCH_SKIP_REG);
-		}
-		else
-		{
-			setz(cl);
-			shl(cl, 1);
-			add(PC, cx);
-		}
+		jumpSkip(true);
 	}
-	template<bool jumpLabel>
 	inline void emit4XNN(uint8_t regX, uint8_t val)
 	{
-		if constexpr (!jumpLabel)
-			xor_(cx, cx);
-
 		cmp(V_REG(regX), val);
-
-		if constexpr (jumpLabel)
-		{
-			jnz("@f", T_NEAR);
-			inc(BRANCH_SKIP_REG);
-		}
-		else
-		{
-			setnz(cl);
-			shl(cl, 1);
-			add(PC, cx);
-		}
+		jumpSkip(false);
 	}
 
-	template<bool jumpLabel>
 	inline void emitEX9E(uint8_t regX)
 	{
-		movzx(rcx, V_REG(regX));
-		and_(rcx, 0xF);
-		mov(cl, KEY(rcx));
-
-		if constexpr (jumpLabel)
-		{
-			test(cl, cl);
-			jnz("@f", T_NEAR);
-			inc(BRANCH_SKIP_REG);
-		}
-		else
-		{
-			shl(cl, 1);
-			add(PC, cx);
-		}
+		emitKeyCompare(regX);
+		jumpSkip(false);
 	}
-	template<bool jumpLabel>
 	inline void emitEXA1(uint8_t regX)
 	{
-		movzx(rcx, V_REG(regX));
-		and_(rcx, 0xF);
-		mov(cl, KEY(rcx));
+		emitKeyCompare(regX);
+		jumpSkip(true);
+	}
 
-		if constexpr (jumpLabel)
+	inline void emitKeyCompare(uint8_t regX)
+	{
+		if (isKnown(regX))
 		{
-			test(cl, cl);
-			jz("@f", T_NEAR);
-			inc(BRANCH_SKIP_REG);
+			const int32_t key = knownRegs[regX] & 0xF;
+			cmp(KEY(key), 0);
 		}
 		else
 		{
-			xor_(cl, 1);
-			shl(cl, 1);
-			add(PC, cx);
+			movzx(rcx, V_REG(regX));
+			and_(rcx, 0xF);
+			cmp(KEY(rcx), 0);
 		}
 	}
 
 	inline void emit6XNN(uint8_t reg, uint8_t val)
 	{
 		mov(V_REG(reg), val);
+		knownRegs[reg] = val;
 	}
 
 	inline void emit7XNN(uint8_t reg, uint8_t val)
 	{
-		add(V_REG(reg), val);
+		if (isKnown(reg))
+			emit6XNN(reg, knownRegs[reg] + val);
+		else
+			add(V_REG(reg), val);
+	}
+
+	// result of an 8XY_ op whose operands are known, and its VF.
+	inline void emitFolded(uint8_t regX, int result, int flag)
+	{
+		emit6XNN(regX, result);
+
+		if (flagDead)
+			knownRegs[0xF] = UNKNOWN;
+		else
+			emit6XNN(0xF, flag);
+	}
+
+	inline void emitVFReset()
+	{
+		if (!Quirks::VFReset) return;
+
+		if (flagDead)
+			knownRegs[0xF] = UNKNOWN;
+		else
+			emit6XNN(0xF, 0);
 	}
 
 	inline void emit8XY0(uint8_t regX, uint8_t regY)
 	{
-		MOV(V_REG(regX), V_REG(regY));
+		if (isKnown(regY))
+			emit6XNN(regX, knownRegs[regY]);
+		else
+		{
+			MOV(V_REG(regX), V_REG(regY));
+			knownRegs[regX] = UNKNOWN;
+		}
 	}
 	inline void emit8XY1(uint8_t regX, uint8_t regY)
 	{
-		OR(V_REG(regX), V_REG(regY));
-		if (Quirks::VFReset) mov(FLAG_REG, 0);
+		if (isKnown(regX) && isKnown(regY))
+			emit6XNN(regX, knownRegs[regX] | knownRegs[regY]);
+		else
+		{
+			OR(V_REG(regX), V_REG(regY));
+			knownRegs[regX] = UNKNOWN;
+		}
+		emitVFReset();
 	}
 	inline void emit8XY2(uint8_t regX, uint8_t regY)
 	{
-		AND(V_REG(regX), V_REG(regY));
-		if (Quirks::VFReset) mov(FLAG_REG, 0);
+		if (isKnown(regX) && isKnown(regY))
+			emit6XNN(regX, knownRegs[regX] & knownRegs[regY]);
+		else
+		{
+			AND(V_REG(regX), V_REG(regY));
+			knownRegs[regX] = UNKNOWN;
+		}
+		emitVFReset();
 	}
 	inline void emit8XY3(uint8_t regX, uint8_t regY)
 	{
-		XOR(V_REG(regX), V_REG(regY));
-		if (Quirks::VFReset) mov(FLAG_REG, 0);
+		if (isKnown(regX) && isKnown(regY))
+			emit6XNN(regX, knownRegs[regX] ^ knownRegs[regY]);
+		else
+		{
+			XOR(V_REG(regX), V_REG(regY));
+			knownRegs[regX] = UNKNOWN;
+		}
+		emitVFReset();
 	}
 	inline void emit8XY4(uint8_t regX, uint8_t regY)
 	{
+		if (isKnown(regX) && isKnown(regY))
+		{
+			const int sum = knownRegs[regX] + knownRegs[regY];
+			emitFolded(regX, sum, sum > 0xFF);
+			return;
+		}
+
 		ADD(V_REG(regX), V_REG(regY));
-		setc(FLAG_REG);
+		if (!flagDead) setc(FLAG_REG);
+
+		knownRegs[regX] = UNKNOWN;
+		knownRegs[0xF] = UNKNOWN;
 	}
 	inline void emit8XY5(uint8_t regX, uint8_t regY)
 	{
+		if (isKnown(regX) && isKnown(regY))
+		{
+			emitFolded(regX, knownRegs[regX] - knownRegs[regY], knownRegs[regX] >= knownRegs[regY]);
+			return;
+		}
+
 		SUB(V_REG(regX), V_REG(regY));
-		setnc(FLAG_REG);
+		if (!flagDead) setnc(FLAG_REG);
+
+		knownRegs[regX] = UNKNOWN;
+		knownRegs[0xF] = UNKNOWN;
 	}
 	inline void emit8XY6(uint8_t regX, uint8_t regY)
 	{
+		const uint8_t regSrc = Quirks::Shifting ? regX : regY;
+
+		if (isKnown(regSrc))
+		{
+			emitFolded(regX, knownRegs[regSrc] >> 1, knownRegs[regSrc] & 0x1);
+			return;
+		}
+
 		if (!Quirks::Shifting) emit8XY0(regX, regY);
 
 		if (regX == 0xF) // small optimization if operand is flag reg.
-			and_(FLAG_REG, 0x1);
+		{
+			if (!flagDead) and_(FLAG_REG, 0x1);
+		}
 		else
 		{
-			MOV(FLAG_REG, V_REG(regX));
-			and_(FLAG_REG, 0x1);
+			if (!flagDead)
+			{
+				MOV(FLAG_REG, V_REG(regX));
+				and_(FLAG_REG, 0x1);
+			}
 			shr(V_REG(regX), 1);
 		}
+
+		knownRegs[regX] = UNKNOWN;
+		knownRegs[0xF] = UNKNOWN;
 	}
 	inline void emit8XY7(uint8_t regX, uint8_t regY)
 	{
+		if (isKnown(regX) && isKnown(regY))
+		{
+			emitFolded(regX, knownRegs[regY] - knownRegs[regX], knownRegs[regY] >= knownRegs[regX]);
+			return;
+		}
+
 		mov(cl, V_REG(regY));
 		sub(cl, V_REG(regX));
 
 		if (regX != 0xF) // small optimization if operand is flag reg.
 			mov(V_REG(regX), cl);
 
-		setnc(FLAG_REG);
+		if (!flagDead) setnc(FLAG_REG);
+
+		knownRegs[regX] = UNKNOWN;
+		knownRegs[0xF] = UNKNOWN;
 	}
 
 	inline void emit8XYE(uint8_t regX, uint8_t regY)
 	{
+		const uint8_t regSrc = Quirks::Shifting ? regX : regY;
+
+		if (isKnown(regSrc))
+		{
+			emitFolded(regX, knownRegs[regSrc] << 1, knownRegs[regSrc] >> 7);
+			return;
+		}
+
 		if (!Quirks::Shifting) emit8XY0(regX, regY);
 
 		if (regX == 0xF) // small optimization if operand is flag reg.
-			shr(FLAG_REG, 7);
+		{
+			if (!flagDead) shr(FLAG_REG, 7);
+		}
 		else
 		{
-			MOV(FLAG_REG, V_REG(regX));
-			shr(FLAG_REG, 7);
+			if (!flagDead)
+			{
+				MOV(FLAG_REG, V_REG(regX));
+				shr(FLAG_REG, 7);
+			}
 			shl(V_REG(regX), 1);
 		}
+
+		knownRegs[regX] = UNKNOWN;
+		knownRegs[0xF] = UNKNOWN;
 	}
 
 	inline void emitANNN(uint16_t val)
 	{
 		mov(I_REG, val);
+		knownI = val;
 	}
 
+	// computed jumps go through a polymorphic inline cache, its slots are filled in by updateInlineCache().
 	inline void emitBNNN(uint16_t val, uint8_t regX)
 	{
+		const uint8_t regOffset = Quirks::Jumping ? regX : 0;
+
+		if (isKnown(regOffset)) // the target is static after all.
+		{
+			emitLinkedEpilogue((val + knownRegs[regOffset]) & 0xFFF);
+			return;
+		}
+
 		mov(PC, val);
 		movzx(cx, Quirks::Jumping ? V_REG(regX) : V_REG(0));
 		add(PC, cx);
 		and_(PC, 0xFFF);
+
+		sub(BUDGET_REG, executed());
+		jle(dispatchLoop);
+
+		InlineCache cache{};
+
+		for (int i = 0; i < InlineCache::SLOTS; i++)
+		{
+			Xbyak::Label next;
+
+			cmp(PC, InlineCache::EMPTY);
+			cache.targets[i] = const_cast<uint8_t*>(getCurr()) - sizeof(uint16_t);
+			jne(next, T_SHORT);
+
+			cache.stubs[i] = emitLinkJump();
+			jmp(dispatchLoop);
+			L(next);
+		}
+
+		pushGuestState();
+		movzx(eax, PC);
+		mov(ARG1.cvt32(), 0x7FFFFFFF); // imm32 placeholder for the index, see publishBlock()
+		pendingCaches.push_back(PendingCache{ cache, getSize() - sizeof(uint32_t) });
+		mov(ARG2, rax);
+		callFunc(CodeAddress::UpdateInlineCache);
+		popGuestState();
+		jmp(dispatchLoop);
 	}
 
 	inline void emitCXNN(uint8_t regX, uint8_t val)
@@ -570,42 +2131,139 @@ public:
 		rdtsc(); // using cpu timestamp as a random number
 		and_(eax, val);
 		mov(V_REG(regX), al);
+		knownRegs[regX] = UNKNOWN;
 	}
 
 	inline void emitDXYN(uint8_t regX, uint8_t regY, uint8_t height)
 	{
 		if (height == 0)
 		{
-			mov(FLAG_REG, 0);
+			emit6XNN(0xF, 0);
 			return;
 		}
 
-		Xbyak::Label loopEnd;
+		if (knownI != UNKNOWN)
+		{
+			emitBakedSprite(regX, regY, height);
+			return;
+		}
+
+		emitSpritePosition(regX, regY);
+		emitSpriteRows(height);
+	}
+
+	// same kernel as ChipSprite::draw(), x is in cl, y in r8 and collisions are accumulated in rdx.
+	inline void emitSpritePosition(uint8_t regX, uint8_t regY)
+	{
+		if (isKnown(regX))
+			mov(ecx, knownRegs[regX] & (ChipState::SCRWidth - 1));
+		else
+		{
+			movzx(ecx, V_REG(regX));
+			and_(ecx, (ChipState::SCRWidth - 1));
+		}
 
-		mov(r8b, V_REG(regY));
-		and_(r8, (ChipState::SCRHeight - 1));
+		if (isKnown(regY))
+			mov(r8d, knownRegs[regY] & (ChipState::SCRHeight - 1));
+		else
+		{
+			movzx(r8d, V_REG(regY));
+			and_(r8d, (ChipState::SCRHeight - 1));
+		}
 
-		mov(r9b, V_REG(regX));
-		and_(r9, (ChipState::SCRWidth - 1));
+		knownRegs[0xF] = UNKNOWN;
+		xor_(edx, edx);
+	}
 
-		mov(FLAG_REG, 0);
+	inline void emitSpriteRows(uint8_t height)
+	{
+		Xbyak::Label loopEnd;
 
 		for (int i = 0; i < height; i++)
 		{
-			Xbyak::Label drawXoring, fullDraw;
+			if (i > 0)
+			{
+				inc(r8d);
+
+				if (Quirks::Clipping)
+				{
+					cmp(r8d, ChipState::SCRHeight);
+					jae(loopEnd, T_NEAR);
+				}
+				else
+					and_(r8d, (ChipState::SCRHeight - 1));
+			}
+
+			lea(eax, ptr[I_FULL_REG + i]);
+			and_(eax, 0xFFF);
+			movzx(eax, RAM_PTR(rax));
+			shl(rax, 56);
 
-			if (IregAllocated) lea(rax, ptr[I_FULL_REG + i]);
+			if (!Quirks::Clipping)
+				ror(rax, cl);
+			else if (hasTier(CPUTier::AVX2))
+				shrx(rax, rax, rcx); // single uop, shifts by cl also write flags.
 			else
+				shr(rax, cl);
+
+			const auto screen = qword[BASE + offsetof(ChipState, screenBuffer) + (r8 * sizeof(uint64_t))];
+
+			mov(r9, screen);
+			and_(r9, rax);
+			or_(rdx, r9);
+			xor_(screen, rax);
+		}
+
+		L(loopEnd);
+
+		test(rdx, rdx);
+		setnz(FLAG_REG);
+	}
+
+	// with I known, the sprite rows are baked in as 64-bit masks already shifted by a known X, or rotated
+	// by cl at runtime. the sprite data is added to the block's ranges, so writing it recompiles the block.
+	void emitBakedSprite(uint8_t regX, uint8_t regY, uint8_t height)
+	{
+		Xbyak::Label loopEnd;
+
+		const uint16_t address = knownI & 0xFFF;
+		dataRanges.push_back(JITRange{ address, static_cast<uint16_t>(address + height) });
+
+		// VF is cleared below, X or Y may be VF.
+		const int32_t knownX = knownRegs[regX], knownY = knownRegs[regY];
+
+		if (knownX == UNKNOWN)
+		{
+			movzx(ecx, V_REG(regX));
+			and_(ecx, (ChipState::SCRWidth - 1));
+		}
+		if (knownY == UNKNOWN)
+		{
+			mov(r8b, V_REG(regY));
+			and_(r8, (ChipState::SCRHeight - 1));
+		}
+
+		xor_(eax, eax);
+		knownRegs[0xF] = UNKNOWN;
+
+		for (int i = 0; i < height; i++)
+		{
+			const uint64_t row = static_cast<uint64_t>(codeRAM[(address + i) & 0xFFF]) << 56;
+			int screenRow = 0;
+
+			if (knownY != UNKNOWN)
 			{
-				movzx(rax, I_REG_PTR);
-				if (i > 0) lea(rax, ptr[rax + i]);
-			}
+				screenRow = (knownY & (ChipState::SCRHeight - 1)) + i;
 
-			and_(rax, 0xFFF);
-			movzx(rax, RAM_PTR(rax));
+				if (Quirks::Clipping && screenRow >= ChipState::SCRHeight)
+					break;
 
-			if (i > 0)
+				screenRow &= (ChipState::SCRHeight - 1);
+			}
+			else if (i > 0)
 			{
+				inc(r8b);
+
 				if (Quirks::Clipping)
 				{
 					cmp(r8b, ChipState::SCRHeight);
@@ -615,73 +2273,131 @@ public:
 					and_(r8b, (ChipState::SCRHeight - 1));
 			}
 
-			mov(rdx, rax);
-			cmp(r9b, 56);
-			jbe(fullDraw); 
-
-			lea(rcx, ptr[r9 - 56]);
-			shr(rdx, cl);
+			if (row == 0) // nothing drawn, no collision.
+				continue;
 
-			if (!Quirks::Clipping)
+			if (knownX != UNKNOWN)
 			{
-				mov(cl, 120);
-				sub(cl, r9b); 
-				shl(rax, cl);
-				or_(rdx, rax);
+				const int x = knownX & (ChipState::SCRWidth - 1);
+				mov(rdx, Quirks::Clipping ? row >> x : std::rotr(row, x));
 			}
+			else
+			{
+				mov(rdx, row);
 
-			jmp(drawXoring);
-			L(fullDraw);
-
-			mov(cl, 56);
-			sub(cl, r9b);
-			shl(rdx, cl);
-
-			L(drawXoring);
-
-			lea(rcx, ptr[BASE + offsetof(ChipState, screenBuffer) + (r8 * sizeof(uint64_t))]);
+				if (!Quirks::Clipping)
+					ror(rdx, cl);
+				else if (hasTier(CPUTier::AVX2))
+					shrx(rdx, rdx, rcx);
+				else
+					shr(rdx, cl);
+			}
 
-			test(qword[rcx], rdx);
-			setnz(al);
-			or_(FLAG_REG, al);
-			xor_(qword[rcx], rdx);
+			const auto& screen = knownY != UNKNOWN ? qword[BASE + (offsetof(ChipState, screenBuffer) + screenRow * sizeof(uint64_t))] :
+				qword[BASE + offsetof(ChipState, screenBuffer) + (r8 * sizeof(uint64_t))];
 
-			inc(r8b);
+			mov(r9, screen);
+			and_(r9, rdx);
+			or_(rax, r9);
+			xor_(screen, rdx);
 		}
 
 		L(loopEnd);
+
+		test(rax, rax);
+		setnz(FLAG_REG);
 	}
 
 	inline void emitFX07(uint8_t regX)
 	{
 		MOV(V_REG(regX), byte[BASE + offsetof(ChipState, delay_timer)]);
+		knownRegs[regX] = UNKNOWN;
 	}
 
 	inline void emitFX15(uint8_t regX)
 	{
-		MOV(byte[BASE + offsetof(ChipState, delay_timer)], V_REG(regX));
+		if (isKnown(regX))
+			mov(byte[BASE + offsetof(ChipState, delay_timer)], knownRegs[regX]);
+		else
+			MOV(byte[BASE + offsetof(ChipState, delay_timer)], V_REG(regX));
 	}
 	inline void emitFX18(uint8_t regX)
 	{
-		MOV(byte[BASE + offsetof(ChipState, sound_timer)], V_REG(regX));
+		if (isKnown(regX))
+			mov(byte[BASE + offsetof(ChipState, sound_timer)], knownRegs[regX]);
+		else
+			MOV(byte[BASE + offsetof(ChipState, sound_timer)], V_REG(regX));
 	}
 
 	inline void emitFX1E(uint8_t regX)
 	{
-		movzx(cx, V_REG(regX));
-		add(I_REG, cx);
+		if (isKnown(regX) && knownI != UNKNOWN)
+		{
+			mov(I_REG, (knownI + knownRegs[regX]) & 0xFFFF);
+			knownI = (knownI + knownRegs[regX]) & 0xFFFF;
+			return;
+		}
+
+		if (isKnown(regX))
+			add(I_REG, knownRegs[regX]);
+		else
+		{
+			movzx(cx, V_REG(regX));
+			add(I_REG, cx);
+		}
+
+		knownI = UNKNOWN;
 	}
 
 	inline void emitFX29(uint8_t regX)
 	{
+		if (isKnown(regX))
+		{
+			emitANNN((knownRegs[regX] & 0xF) * 5);
+			return;
+		}
+
 		movzx(rcx, V_REG(regX));
 		and_(rcx, 0xF);
 		lea(rcx, ptr[rcx + (rcx * 4)]);
 		mov(I_REG, cx);
+		knownI = UNKNOWN;
+	}
+
+	inline void emitFX33(uint8_t regX, uint16_t nextPC)
+	{
+		storeBCD(regX);
+		ramStored = true;
+		emitStoreInvalidation(2, nextPC);
 	}
 
-	inline void emitFX33(uint8_t regX)
+	// the decimal digits of VX to [I, I + 2].
+	inline void storeBCD(uint8_t regX)
 	{
+		if (isKnown(regX))
+		{
+			const uint8_t digits[3] = { static_cast<uint8_t>(knownRegs[regX] / 100), static_cast<uint8_t>(knownRegs[regX] / 10 % 10), static_cast<uint8_t>(knownRegs[regX] % 10) };
+
+			if (knownI == UNKNOWN)
+				movzx(ecx, I_REG);
+
+			for (int i = 0; i < 3; i++)
+			{
+				if (knownI != UNKNOWN)
+				{
+					const int32_t offset = (knownI + i) & 0xFFF;
+					mov(RAM_PTR(offset), digits[i]);
+				}
+				else
+				{
+					lea(edx, ptr[rcx + i]);
+					and_(edx, 0xFFF);
+					mov(RAM_PTR(rdx), digits[i]);
+				}
+			}
+			return;
+		}
+
 		movzx(eax, V_REG(regX));
 		lea(ecx, ptr[rax + 4 * rax]);
 		lea(r8d, ptr[rax + 8 * rcx]);
@@ -711,52 +2427,110 @@ public:
 		mov(RAM_PTR(rcx), al);
 	}
 
-	inline void emitFX55(uint8_t regX)
+	inline void emitFX55(uint8_t regX, uint16_t nextPC)
 	{
 		store<true>(regX);
+		ramStored = true;
+		emitStoreInvalidation(regX, nextPC, Quirks::MemoryIncrement ? regX + 1 : 0);
+		emitMemoryIncrement(regX);
+	}
 
-		movzx(ARG1, I_REG);
-		lea(ARG2, ptr[ARG1 + regX]);
+	// a store to [I, I + length] only calls out when one of its lines holds code, the blocks covering it are
+	// recompiled then. if the block being run was one of them, it's left for nextPC with increment added to I.
+	inline void emitStoreInvalidation(uint8_t length, uint16_t nextPC, uint8_t increment = 0)
+	{
+		Xbyak::Label invalidate, next;
 
-		push(BASE);
-		if (blockBranches > 0) push(BRANCH_SKIP_REG);
-		callFunc((size_t)invalidateBlocks);
-		if (blockBranches > 0) pop(BRANCH_SKIP_REG);
-		pop(BASE);
+		testCodeLines(length);
+		jnz(invalidate, T_NEAR);
+		L(next);
+
+		emitCold(invalidate, [this, length, nextPC, increment, next] {
+			// allocated registers are caller-saved.
+			std::vector<Xbyak::Reg64> saved{};
+
+			for (int reg = 0; reg < 16; reg++)
+			{
+				if (!(PINNED_MASK & (1 << reg)) && heldRegs[reg] != nullptr)
+					saved.push_back(heldRegs[reg]->cvt64());
+			}
 
-		if (Quirks::MemoryIncrement)
-			add(I_REG, regX + 1);
+			for (const auto& reg : saved) push(reg);
+			if (saved.size() % 2) sub(rsp, 8);
+
+			pushGuestState();
+			movzx(ARG1, I_REG);
+			lea(ARG2, ptr[ARG1 + length]);
+			mov(ARG3, blockStartPC);
+			callFunc(CodeAddress::InvalidateBlocks);
+			popGuestState();
+
+			if (saved.size() % 2) add(rsp, 8);
+			for (auto reg = saved.rbegin(); reg != saved.rend(); reg++) pop(*reg);
+
+			test(al, al);
+			jz(next, T_NEAR);
+
+			if (increment != 0) add(I_REG, increment);
+			emitLinkedEpilogue(nextPC, executed(), false);
+		});
+	}
+
+	// ZF is cleared when one of the lines of [I, I + length] holds code.
+	inline void testCodeLines(uint8_t length)
+	{
+		movzx(eax, I_REG);
+		and_(eax, 0xFFF);
+		lea(edx, ptr[rax + length]);
+		and_(edx, 0xFFF);
+		shr(eax, ChipJITState::LINE_SHIFT);
+		shr(edx, ChipJITState::LINE_SHIFT);
+		movAddress(rcx, CodeAddress::CodeLines);
+		movzx(eax, byte[rcx + rax]);
+		or_(al, byte[rcx + rdx]);
 	}
 
 	inline void emitFX65(uint8_t regX)
 	{
 		store<false>(regX);
-		if (Quirks::MemoryIncrement) add(I_REG, regX + 1);
+		emitMemoryIncrement(regX);
+	}
+
+	inline void emitMemoryIncrement(uint8_t regX)
+	{
+		if (!Quirks::MemoryIncrement) return;
+
+		add(I_REG, regX + 1);
+		if (knownI != UNKNOWN) knownI = (knownI + regX + 1) & 0xFFFF;
 	}
 
-	inline void emitFX0A(uint8_t regX)
+	inline void emitFX0A(uint8_t regX, uint16_t nextPC)
 	{
 		Xbyak::Label firstCall, inputReleased, end, decrPC;
 
 		cmp(byte[BASE + offsetof(ChipState, firstFX0ACall)], 1);
-		jz(firstCall);
+		jz(firstCall, T_NEAR);
 
 		cmp(qword[BASE + offsetof(ChipState, inputReg)], 0);
 		jz(inputReleased);
-		jmp(decrPC);
-
-		L(firstCall);
-		lea(rax, REG_PTR(regX));
-		mov(qword[BASE + offsetof(ChipState, inputReg)], rax);
-		mov(byte[BASE + offsetof(ChipState, firstFX0ACall)], 0);
 
 		L(decrPC);
-		sub(PC, 2);
+		mov(PC, (nextPC - 2) & 0xFFF);
 		jmp(end);
 
+		emitCold(firstCall, [this, regX, decrPC] {
+			lea(rax, REG_PTR(regX));
+			mov(qword[BASE + offsetof(ChipState, inputReg)], rax);
+			mov(byte[BASE + offsetof(ChipState, firstFX0ACall)], 0);
+			jmp(decrPC, T_NEAR);
+		});
+
 		L(inputReleased);
 		mov(byte[BASE + offsetof(ChipState, firstFX0ACall)], 1);
+		if (GET_VREG(regX)) mov(*Vreg, REG_PTR(regX)); // the key was written to memory.
+		mov(PC, nextPC & 0xFFF);
 
 		L(end);
+		emitEpilogue();
 	}
 };
\ No newline at end of file
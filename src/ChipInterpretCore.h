@@ -1,8 +1,10 @@
+#pragma once
 #include <random>
 
 #include "ChipState.h"
 #include "ChipCore.h"
 #include "Quirks.h"
+#include "ChipSprite.h"
 
 extern ChipState s;
 
@@ -138,7 +140,7 @@ public:
 			regX = rngDistr(rngEng) & doubleNibble;
 			break;
 		case 0xD000: 
-			drawSprite(regX % ChipState::SCRWidth, regY % ChipState::SCRHeight, opcode & 0x000F);
+			s.V[0xF] = ChipSprite::draw(s, regX % ChipState::SCRWidth, regY % ChipState::SCRHeight, opcode & 0x000F, Quirks::Clipping);
 			break;
 		case 0xE000:
 			switch (opcode & 0x00FF)
@@ -225,46 +227,4 @@ private:
 	{
 		std::memset(s.screenBuffer.data(), 0, sizeof(s.screenBuffer));
 	}
-
-	inline void drawSprite(uint8_t Xpos, uint8_t Ypos, uint8_t height)
-	{
-		s.V[0xF] = 0;
-		const bool partialDraw = Xpos > 56;
-
-		for (int i = 0; i < height; i++)
-		{
-			uint8_t spriteRow = s.RAM[(s.I + i) & 0xFFF];
-
-			if (Quirks::Clipping)
-			{
-				if (Ypos >= ChipState::SCRHeight)
-					break;
-			}
-			else
-				Ypos %= ChipState::SCRHeight;
-
-			uint64_t spriteMask;
-
-			if (partialDraw)
-			{
-				uint64_t leftPart = static_cast<uint64_t>(spriteRow) >> (Xpos - 56);
-
-				if (Quirks::Clipping)
-					spriteMask = leftPart;
-				else
-				{
-					uint64_t rightPart = static_cast<uint64_t>(spriteRow) << (64 - (Xpos - 56));
-					spriteMask = leftPart | rightPart;
-				}
-			}
-			else
-				spriteMask = static_cast<uint64_t>(spriteRow) << (63 - Xpos - 7);
-
-			uint64_t& screenRow = s.screenBuffer[Ypos];
-			s.V[0xF] |= ((screenRow & spriteMask) != 0);
-
-			screenRow ^= spriteMask;
-			Ypos++;
-		}
-	}
 };
\ No newline at end of file
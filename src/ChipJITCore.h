@@ -1,14 +1,21 @@
 #include <fstream>
+#include <atomic>
 #include <random>
 #include <array>
 #include <vector>
 #include <filesystem>
+#include <sstream>
+#include <iomanip>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
 
 #include <udis86.h>
 
 #include "ChipCore.h"
 #include "ChipEmitter.h"
 #include "ChipJITState.h"
+#include "ChipInterpretCore.h"
 
 #include "macros.h"
 
@@ -18,32 +25,160 @@ extern ChipJITState JIT;
 class ChipJITCore : public ChipCore
 {
 public:
-	FORCE_INLINE uint64_t execute()
+	~ChipJITCore()
 	{
-		auto map = JIT.blockMap[s.pc];
+		if (!compiler.joinable()) return;
 
-		if (!map.isValid) [[unlikely]]
-			return compileBlock();
+		{
+			std::lock_guard lock{ compileMutex };
+			stopCompiler = true;
+		}
 
-		auto& block = JIT.blocks[map.block];
-		s.pc = block.endPC;
-		return c.execute(block.cacheOffset);
+		compileReady.notify_one();
+		compiler.join();
+	}
+
+	// runs exactly the given number of instructions.
+	inline uint64_t execute(uint64_t instructions)
+	{
+		int64_t budget = static_cast<int64_t>(instructions);
+		const uint8_t* entry { nullptr };
+
+		while (budget > 0)
+		{
+			// a counted copy was looked up right before, its block is still valid.
+			if (tiered && entry == nullptr && !enterNative())
+			{
+				budget -= interpretBlock(budget);
+				continue;
+			}
+
+			budget -= c.execute(budget, nullptr, entry);
+			entry = nullptr;
+
+			const uint16_t pc = s.pc & 0xFFF;
+
+			// the block at PC is longer than what's left of the budget. without one, it was a miss in tiered mode.
+			if (budget <= 0 || JIT.loadEntry(pc) == nullptr)
+				continue;
+
+			if (!tiered)
+				entry = getCountedBlock(pc);
+			else if (JIT.countedEntries[pc] != nullptr)
+				entry = JIT.countedEntries[pc];
+			else
+				budget -= interpretBlock(budget); // only hot code is compiled
+		}
+
+		return instructions;
+	}
+
+	// stays inside the dispatcher until running is cleared.
+	inline uint64_t execute(const std::atomic<bool>& running)
+	{
+		static_assert(sizeof(std::atomic<bool>) == sizeof(bool) && std::atomic<bool>::is_always_lock_free);
+		const auto flag = reinterpret_cast<const volatile bool*>(&running);
+
+		if (!tiered)
+			return c.execute(CHAINED_INSTR_BUDGET, flag);
+
+		uint64_t executed { 0 };
+
+		while (running.load(std::memory_order_relaxed))
+			executed += enterNative() ? c.execute(CHAINED_INSTR_BUDGET, flag) : interpretBlock(CHAINED_INSTR_BUDGET);
+
+		return executed;
 	}
 
 	inline void clearJITCache()
 	{
+		waitForCompiler();
+
 		JIT.reset();
 		c.clearCache();
+
+		regionAge.fill(0);
+		generation = 0;
+		region = 0;
+
+		hits.fill(0);
+		hotPCs.clear();
+		ramCopied = false;
+
+		{
+			std::lock_guard lock{ compileMutex };
+			batch.clear();
+		}
+	}
+
+	// tiered mode interprets cold code and compiles blocks on a separate thread once they get hot, new code doesn't
+	// stall the guest while it's compiled and compiled code keeps running. only called while nothing is executing.
+	inline void setTieredCompilation(bool enabled)
+	{
+		waitForCompiler();
+		flushWrites();
+		tiered = enabled;
+
+		if (tiered && !compiler.joinable())
+			compiler = std::thread{ &ChipJITCore::compilerThread, this };
+	}
+
+	inline bool getTieredCompilation() const { return tiered; }
+
+	// blocks are compiled with execution counters first, once one gets hot it's recompiled with what they observed.
+	// compiled code is dropped so every block is profiled.
+	inline void setProfileGuided(bool enabled)
+	{
+		waitForCompiler();
+		profileGuided = enabled;
+		clearJITCache();
+	}
+
+	inline bool getProfileGuided() const { return profileGuided; }
+
+	// blocks run for the first time are copied together from precompiled stencils, which is much faster than emitting
+	// them. the ones that keep running are compiled by the emitter once their entry counter runs out.
+	inline void setBaselineTier(bool enabled)
+	{
+		waitForCompiler();
+		baselineTier = enabled;
+		clearJITCache();
+	}
+
+	inline bool getBaselineTier() const { return baselineTier; }
+
+	// called after a ROM is loaded (and its code cache), compiles the code reachable from the entry point so the ROM
+	// doesn't start on a stream of block misses. in tiered mode the compiler thread does it while the ROM starts interpreted.
+	void precompile()
+	{
+		waitForCompiler();
+		hotPCs.push_back(0x200);
+
+		if (tiered)
+		{
+			startCompiler(true);
+			return;
+		}
+
+		compileBatch(hotPCs, true);
+		hotPCs.clear();
 	}
 
-	inline void setSlowMode(bool enable)
+	inline CPUTier getHostCPUTier() const { return c.getHostTier(); }
+	inline CPUTier getCPUTier() const { return c.getTier(); }
+
+	// capped at what the host supports, compiled code is dropped so every block uses the new tier.
+	inline void setCPUTier(CPUTier tier)
 	{
-		instructionsPerBlock = enable ? 1 : BLOCK_MAX_INSTR;
+		waitForCompiler();
+		c.setTier(tier);
 		clearJITCache();
 	}
 
 	void dumpCode(const std::filesystem::path& path)
 	{
+		waitForCompiler();
+
 		std::ofstream outFile(path, std::ios::out);
 		if (!outFile) return;
 
@@ -55,72 +190,908 @@ public:
 			udInitialized = true;
 		}
 
-		for (const auto& block : JIT.blocks)
-		{
-			if (JIT.blockMap[block.startPC].isValid)
-			{
-				outFile << "JIT Block at PC: " << block.startPC << "-" << block.endPC << "\n--------------------------------\n";
+		for (const auto& block : JIT.blocks)
+		{
+			if (JIT.blockEntries[block.startPC] != nullptr)
+			{
+				outFile << (block.baseline ? "Baseline Block at PC: " : "JIT Block at PC: ");
+
+				for (const auto& range : block.ranges)
+					outFile << range.start << "-" << range.end << (&range != &block.ranges.back() ? ", " : "");
+
+				outFile << "\n--------------------------------\n";
+
+				ud_set_input_buffer(&ud_obj, c.getCodePtr() + block.cacheOffset, block.cacheSize);
+
+				while (ud_disassemble(&ud_obj))
+					outFile << ud_insn_asm(&ud_obj) << "\n";
+
+				outFile << "\n";
+			}
+		}
+	}
+
+	// compiled code can be kept in files under dir between runs, an empty path turns them off.
+	inline void setCodeCacheDir(const std::filesystem::path& dir) { codeCacheDir = dir; }
+
+	// called right after a ROM is loaded into RAM, maps in the code earlier runs compiled for it with the same quirks
+	// and CPU tier. blocks compiled from code the ROM had modified by then are dropped.
+	bool loadCodeCache()
+	{
+		clearJITCache();
+		romHash = hashBytes(FNV_OFFSET, s.RAM.data(), s.RAM.size());
+		cacheChanged = false;
+
+		if (codeCacheDir.empty()) return false;
+
+		std::ifstream in(getCachePath(), std::ios::binary);
+		if (!in) return false;
+
+		CodeCacheHeader header{};
+		read(in, header);
+
+		if (!in || header != getCacheHeader()) return false;
+
+		std::array<uint8_t, ChipState::RAM_SIZE> savedRAM{};
+		std::vector<uint8_t> code{};
+		uint32_t codeSize{}, blockCount{};
+
+		read(in, savedRAM);
+		read(in, regionAge);
+		read(in, generation);
+		read(in, region);
+		read(in, codeSize);
+		readVector(in, code, ChipEmitter::MAX_CACHE_SIZE - c.getDispatcherSize());
+		read(in, blockCount);
+
+		// everything read from here on is checked against the layout, a corrupt or truncated file fails the stream.
+		const size_t codeEnd = c.getDispatcherSize() + code.size();
+		const auto inCode = [&](uint64_t offset, uint64_t size) { return offset >= c.getDispatcherSize() && offset + size <= codeEnd; };
+
+		for (uint32_t i = 0; in && i < std::min<uint32_t>(blockCount, ChipState::RAM_SIZE); i++)
+		{
+			JITBlock block{ 0 };
+
+			read(in, block.startPC);
+			read(in, block.cacheOffset);
+			read(in, block.cacheSize);
+			uint8_t baseline{};
+			read(in, baseline);
+			block.baseline = baseline != 0;
+			readVector(in, block.ranges, ChipState::RAM_SIZE);
+
+			if (block.startPC >= ChipState::RAM_SIZE || (block.startPC & 1) != 0 || baseline > 1)
+			{
+				in.setstate(std::ios::failbit);
+				break;
+			}
+
+			JIT.blockMap[block.startPC].block = static_cast<int16_t>(i);
+			JIT.blocks.push_back(std::move(block));
+		}
+
+		for (auto& entry : JIT.blockEntries) entry = readCode(in, codeEnd);
+		for (auto& entry : JIT.countedEntries) entry = readCode(in, codeEnd);
+
+		for (auto& links : JIT.blockLinks)
+		{
+			uint32_t count{};
+			read(in, count);
+
+			for (uint32_t i = 0; in && i < std::min<uint32_t>(count, ChipEmitter::MAX_CACHE_SIZE); i++)
+			{
+				links.push_back(readCode(in, codeEnd));
+				if (links.back() == nullptr) in.setstate(std::ios::failbit);
+			}
+		}
+
+		uint32_t cacheCount{}, liveCaches{};
+		read(in, cacheCount);
+		read(in, liveCaches);
+		JIT.inlineCaches.resize(std::min<uint32_t>(cacheCount, ChipEmitter::MAX_CACHE_SIZE));
+
+		for (uint32_t i = 0; in && i < std::min<uint32_t>(liveCaches, ChipEmitter::MAX_CACHE_SIZE); i++)
+		{
+			uint32_t index{};
+			InlineCache cache{};
+
+			read(in, index);
+			for (auto& target : cache.targets) target = readCode(in, codeEnd);
+			for (auto& stub : cache.stubs) stub = readCode(in, codeEnd);
+			read(in, cache.next);
+			read(in, cache.block);
+
+			const bool valid = index < JIT.inlineCaches.size() && cache.next < InlineCache::SLOTS && cache.block >= 0 && cache.block < static_cast<int16_t>(JIT.blocks.size()) &&
+				std::find(cache.targets.begin(), cache.targets.end(), nullptr) == cache.targets.end() &&
+				std::find(cache.stubs.begin(), cache.stubs.end(), nullptr) == cache.stubs.end();
+
+			if (!valid)
+				in.setstate(std::ios::failbit);
+			else
+				JIT.inlineCaches[index] = cache;
+		}
+
+		readVector(in, JIT.relocations, ChipEmitter::MAX_CACHE_SIZE);
+
+		const bool validBlocks = std::all_of(JIT.blocks.begin(), JIT.blocks.end(), [&](const JITBlock& block) {
+			return JIT.blockEntries[block.startPC] == nullptr || (inCode(block.cacheOffset, block.cacheSize) &&
+				(block.cacheOffset - c.getDispatcherSize()) / REGION_SIZE < CACHE_REGIONS);
+		});
+
+		const bool validRelocations = std::all_of(JIT.relocations.begin(), JIT.relocations.end(), [&](const CodeRelocation& relocation) {
+			return inCode(relocation.offset, sizeof(uint64_t)) && static_cast<uint8_t>(relocation.target) < CODE_ADDRESSES;
+		});
+
+		if (!in || blockCount != JIT.blocks.size() || !validBlocks || !validRelocations || region >= CACHE_REGIONS ||
+			codeSize < regionStart(region) || codeSize > codeEnd)
+		{
+			clearJITCache();
+
+			std::error_code error;
+			std::filesystem::remove(getCachePath(), error);
+
+			return false;
+		}
+
+		c.restoreCode(code);
+		c.setCodeSize(codeSize);
+
+		for (int16_t i = 0; i < static_cast<int16_t>(JIT.blocks.size()); i++)
+		{
+			const auto& block = JIT.blocks[i];
+			if (JIT.blockEntries[block.startPC] == nullptr) continue;
+
+			JIT.addBlockLines(i);
+			if (block.baseline) JIT.entryCounters[block.startPC] = BASELINE_ENTRIES;
+
+			const bool modified = std::any_of(block.ranges.begin(), block.ranges.end(), [&](const JITRange& range) {
+				for (int addr = range.start; addr < range.end; addr++)
+				{
+					if (savedRAM[addr & 0xFFF] != s.RAM[addr & 0xFFF]) return true;
+				}
+				return false;
+			});
+
+			if (modified) ChipEmitter::dropBlock(i);
+		}
+
+		for (int pc = 0; pc < ChipState::RAM_SIZE; pc++)
+			ChipEmitter::relinkBlock(pc);
+
+		return true;
+	}
+
+	// writes the code cache of the current ROM, if anything was compiled since it was loaded.
+	void saveCodeCache()
+	{
+		waitForCompiler();
+		flushWrites();
+
+		if (codeCacheDir.empty() || !cacheChanged) return;
+		cacheChanged = false;
+
+		// loading only accepts blocks at even PCs, code jumped into at an odd address isn't kept.
+		if (std::any_of(JIT.blocks.begin(), JIT.blocks.end(), [](const JITBlock& block) { return (block.startPC & 1) != 0; }))
+			return;
+
+		std::error_code error;
+		std::filesystem::create_directories(codeCacheDir, error);
+
+		// runs of the same ROM may save at the same time, each writes its own file and renames it over the old one.
+		const auto path = getCachePath();
+		auto tempPath = path;
+		tempPath += "." + std::to_string(std::random_device{}()) + ".tmp";
+
+		std::ofstream out(tempPath, std::ios::binary);
+		if (!out) return;
+
+		const uint8_t* code = c.getCodePtr();
+
+		write(out, getCacheHeader());
+		write(out, s.RAM); // the valid blocks match it, loading compares their ranges to the new RAM.
+		write(out, regionAge);
+		write(out, generation);
+		write(out, region);
+		write(out, static_cast<uint32_t>(c.getCodeSize()));
+		writeVector(out, std::vector<uint8_t>(code + c.getDispatcherSize(), code + usedCodeEnd()));
+		write(out, static_cast<uint32_t>(JIT.blocks.size()));
+
+		for (const auto& block : JIT.blocks)
+		{
+			write(out, block.startPC);
+			write(out, block.cacheOffset);
+			write(out, block.cacheSize);
+			write(out, block.baseline);
+			writeVector(out, block.ranges);
+		}
+
+		for (auto entry : JIT.blockEntries) writeCode(out, entry);
+		for (auto entry : JIT.countedEntries) writeCode(out, entry);
+
+		for (const auto& links : JIT.blockLinks)
+		{
+			write(out, static_cast<uint32_t>(links.size()));
+			for (auto stub : links) writeCode(out, stub);
+		}
+
+		// only the entries of live sites, free ones are written as the size of the table.
+		const auto isLive = [](const InlineCache& cache) { return cache.block != -1; };
+
+		write(out, static_cast<uint32_t>(JIT.inlineCaches.size()));
+		write(out, static_cast<uint32_t>(std::count_if(JIT.inlineCaches.begin(), JIT.inlineCaches.end(), isLive)));
+
+		for (uint32_t i = 0; i < JIT.inlineCaches.size(); i++)
+		{
+			const auto& cache = JIT.inlineCaches[i];
+			if (!isLive(cache)) continue;
+
+			write(out, i);
+			for (auto target : cache.targets) writeCode(out, target);
+			for (auto stub : cache.stubs) writeCode(out, stub);
+			write(out, cache.next);
+			write(out, cache.block);
+		}
+
+		writeVector(out, JIT.relocations);
+		out.close();
+
+		if (out)
+			std::filesystem::rename(tempPath, path, error);
+
+		if (!out || error)
+			std::filesystem::remove(tempPath, error);
+	}
+private:
+	ud_t ud_obj;
+	bool udInitialized{ false };
+
+	std::filesystem::path codeCacheDir{};
+	uint64_t romHash{ 0 };
+	bool cacheChanged{ false }; // code was compiled since the cache file was loaded
+
+	static constexpr uint32_t CODE_CACHE_MAGIC = 0x3843454D; // "ME8C"
+
+	// also hashed into the file name, so it has no padding.
+	struct CodeCacheHeader
+	{
+		uint32_t magic{};
+		uint32_t version{};
+		uint64_t romHash{};
+
+		// blocks jump into the dispatcher, it's rebuilt by every run and has to be laid out the same.
+		uint32_t dispatcherSize{};
+		uint32_t dispatchLoop{};
+		uint32_t dispatchExhausted{};
+
+		uint8_t quirks{};
+		CPUTier tier{};
+		uint8_t profiled{};
+		uint8_t baseline{};
+
+		bool operator==(const CodeCacheHeader&) const = default;
+	};
+
+	static_assert(std::has_unique_object_representations_v<CodeCacheHeader>);
+
+	CodeCacheHeader getCacheHeader() const
+	{
+		const uint8_t quirks = Quirks::Pack();
+
+		return CodeCacheHeader{ CODE_CACHE_MAGIC, ChipEmitter::CODE_VERSION, romHash, static_cast<uint32_t>(c.getDispatcherSize()),
+			static_cast<uint32_t>(c.getDispatchLoopOffset()), static_cast<uint32_t>(c.getDispatchExhaustedOffset()), quirks, c.getTier(), profileGuided, baselineTier };
+	}
+
+	std::filesystem::path getCachePath() const
+	{
+		const CodeCacheHeader header = getCacheHeader();
+
+		std::ostringstream name{};
+		name << std::hex << std::setfill('0') << std::setw(16) << hashBytes(FNV_OFFSET, &header, sizeof(header)) << ".jit";
+
+		return codeCacheDir / name.str();
+	}
+
+	static constexpr uint64_t FNV_OFFSET = 0xCBF29CE484222325;
+
+	static uint64_t hashBytes(uint64_t hash, const void* data, size_t size)
+	{
+		for (size_t i = 0; i < size; i++)
+			hash = (hash ^ static_cast<const uint8_t*>(data)[i]) * 0x100000001B3;
+
+		return hash;
+	}
+
+	template <typename T>
+	static inline void write(std::ostream& out, const T& value) { out.write(reinterpret_cast<const char*>(&value), sizeof(T)); }
+
+	template <typename T>
+	static inline void read(std::istream& in, T& value) { in.read(reinterpret_cast<char*>(&value), sizeof(T)); }
+
+	template <typename T>
+	static void writeVector(std::ostream& out, const std::vector<T>& values)
+	{
+		write(out, static_cast<uint32_t>(values.size()));
+		out.write(reinterpret_cast<const char*>(values.data()), values.size() * sizeof(T));
+	}
+
+	template <typename T>
+	static void readVector(std::istream& in, std::vector<T>& values, size_t maxSize)
+	{
+		uint32_t size{};
+		read(in, size);
+
+		if (size > maxSize)
+		{
+			in.setstate(std::ios::failbit);
+			return;
+		}
+
+		values.resize(size);
+		in.read(reinterpret_cast<char*>(values.data()), size * sizeof(T));
+	}
+
+	// pointers into the code cache are stored as offsets from its start, 0 for nullptr.
+	inline void writeCode(std::ostream& out, const uint8_t* code) const
+	{
+		write(out, static_cast<uint32_t>(code != nullptr ? code - c.getCodePtr() : 0));
+	}
+
+	// 0 is nullptr, an offset outside the restored code [dispatcher, codeEnd) fails the stream.
+	inline uint8_t* readCode(std::istream& in, size_t codeEnd) const
+	{
+		uint32_t offset{};
+		read(in, offset);
+
+		if (offset == 0) return nullptr;
+
+		if (offset < c.getDispatcherSize() || offset >= codeEnd)
+		{
+			in.setstate(std::ios::failbit);
+			return nullptr;
+		}
+
+		return const_cast<uint8_t*>(c.getCodePtr()) + offset;
+	}
+
+private:
+	ChipEmitter c{ (size_t)compileFromDispatcher, this };
+
+	static constexpr uint64_t BLOCK_MAX_INSTR = 64;
+	static constexpr uint64_t CALL_INLINE_MAX_INSTR = 16; // callee up to its 00EE
+
+	// instructions run between checks of the running flag.
+	static constexpr int64_t CHAINED_INSTR_BUDGET = 0x10000;
+
+	void initialize() override
+	{
+		s.reset();
+		clearJITCache();
+	}
+
+	// called by the dispatcher on a block miss, returns the code to jump to.
+	static const uint8_t* compileFromDispatcher(ChipJITCore* core, uint16_t pc)
+	{
+		return core->tiered ? core->c.getDispatchExit() : core->compileBlock(pc);
+	}
+
+	// tiered mode: times a PC is dispatched to the interpreter before its block is queued for the compiler thread.
+	static constexpr uint16_t TIER_UP_THRESHOLD = 32;
+
+	bool tiered{ false };
+	bool profileGuided{ false };
+	bool baselineTier{ false };
+
+	// entries of a baseline block before it's compiled by the emitter, a loop back to its start counts too.
+	static constexpr uint32_t BASELINE_ENTRIES = 64;
+	ChipInterpretCore interpreter{};
+
+	std::array<uint16_t, ChipState::RAM_SIZE> hits{};
+	std::vector<uint16_t> hotPCs{}; // waiting for the compiler thread to finish its batch
+
+	// the compiler thread owns the emitter while compiling is set. it emits into the current region past everything
+	// the guest can run, and publishes each block under JIT.mutex (see compileBlock()), in the meantime compiled
+	// blocks keep running and cold code is interpreted. it compiles from a copy of RAM, the blocks covering stores
+	// made since the copy are dropped once it's done.
+	std::thread compiler{};
+	std::mutex compileMutex{};
+	std::condition_variable compileReady{};
+	std::atomic<bool> compiling{ false };
+	bool stopCompiler{ false };
+
+	std::vector<uint16_t> batch{}; // what's left of it once the compiler thread is done waits for a region to be evicted
+	bool followBatch{ false };
+	std::array<uint8_t, ChipState::RAM_SIZE> compileRAM{};
+	bool ramCopied{ false }; // compileRAM was compiled from and isn't compared to RAM yet
+
+	// compiles the blocks at pcs that aren't compiled yet. following exits adds the PCs each block exits to, which
+	// compiles everything reachable through direct jumps, calls and skips, the blocks dispatcher misses would find one
+	// at a time. computed jumps and returns to call sites that weren't reached are left to run time.
+	// returns the number of pcs done, the compiler thread stops early when the region is full.
+	size_t compileBatch(std::vector<uint16_t>& pcs, bool followExits)
+	{
+		for (size_t i = 0; i < pcs.size(); i++)
+		{
+			if (JIT.loadEntry(pcs[i]) != nullptr) continue;
+
+			// stops before the first region would be evicted again.
+			if (followExits && region == CACHE_REGIONS - 1) break;
+
+			// the guest may be running code in any other region, the compiler thread leaves evicting to startCompiler().
+			if (std::this_thread::get_id() == compiler.get_id() && !hasRoom())
+				return i;
+
+			compileBlock(pcs[i], followExits ? &pcs : nullptr);
+		}
+
+		return pcs.size();
+	}
+
+	void compilerThread()
+	{
+		std::unique_lock lock{ compileMutex };
+
+		while (true)
+		{
+			compileReady.wait(lock, [this] { return compiling.load(std::memory_order_relaxed) || stopCompiler; });
+			if (stopCompiler) return;
+
+			c.codeRAM = compileRAM.data();
+			const size_t done = compileBatch(batch, followBatch);
+			c.codeRAM = s.RAM.data();
+			batch.erase(batch.begin(), batch.begin() + done);
+
+			compiling.store(false, std::memory_order_release);
+			compiling.notify_all();
+		}
+	}
+
+	// between blocks, nothing is running. the hot PCs are queued after what's left of the last batch.
+	inline void startCompiler(bool followExits = false)
+	{
+		reserveCode();
+		compileRAM = s.RAM;
+		ramCopied = true;
+
+		{
+			std::lock_guard lock{ compileMutex };
+			followBatch = followExits || (followBatch && !batch.empty());
+			batch.insert(batch.end(), hotPCs.begin(), hotPCs.end());
+			hotPCs.clear();
+			compiling.store(true, std::memory_order_relaxed);
+		}
+
+		compileReady.notify_one();
+	}
+
+	inline void waitForCompiler() const
+	{
+		compiling.wait(true, std::memory_order_acquire);
+	}
+
+	// drops the blocks covering the lines stored to since the compiler thread copied RAM. compileBlock() checks a block
+	// against RAM before it's published, this covers compiled stores racing with it (they check the lines unlocked).
+	inline void flushWrites()
+	{
+		if (!ramCopied) return;
+		ramCopied = false;
+
+		constexpr int LINE_SIZE = 1 << ChipJITState::LINE_SHIFT;
+
+		for (int line = 0; line < ChipState::RAM_SIZE; line += LINE_SIZE)
+		{
+			if (std::memcmp(&compileRAM[line], &s.RAM[line], LINE_SIZE) == 0) continue;
+
+			for (int addr = line; addr < line + LINE_SIZE; addr++)
+			{
+				if (compileRAM[addr] != s.RAM[addr])
+					ChipEmitter::invalidateWrite(addr, addr);
+			}
+		}
+	}
+
+	// dispatches the current PC in tiered mode, returns whether its block can run natively. otherwise it's counted
+	// and interpreted. blocks are published while the compiler thread runs, the rest of the JIT state waits for it.
+	bool enterNative()
+	{
+		const uint16_t pc = s.pc & 0xFFF;
+		const bool idle = !compiling.load(std::memory_order_acquire);
+
+		if (idle) flushWrites();
+
+		if (JIT.loadEntry(pc) == nullptr)
+		{
+			// promoted by its profile, it was hot already.
+			if (idle && JIT.hotBlocks[pc]) hotPCs.push_back(pc);
+
+			if (++hits[pc] >= TIER_UP_THRESHOLD)
+			{
+				hits[pc] = 0; // code invalidated after it was compiled has to get hot again
+				hotPCs.push_back(pc);
+			}
+		}
+
+		// what's left of a batch continues once its region is evicted.
+		if (idle && (!hotPCs.empty() || !batch.empty()))
+			startCompiler();
+
+		return JIT.loadEntry(pc) != nullptr;
+	}
+
+	// interprets up to the next instruction that doesn't continue at the following one, returns the number of instructions run.
+	int64_t interpretBlock(int64_t budget)
+	{
+		int64_t executed { 0 };
+		uint16_t opcode;
+
+		do
+		{
+			s.pc &= 0xFFF;
+			opcode = (s.RAM[s.pc] << 8) | s.RAM[(s.pc + 1) & 0xFFF];
+			const uint16_t writeStart = s.I;
+
+			interpreter.execute();
+			executed++;
+
+			// stores to compiled code invalidate it like they do in compiled blocks, after the store: a block the
+			// compiler thread publishes in between is checked against RAM.
+			if ((opcode & 0xF0FF) == 0xF033 || (opcode & 0xF0FF) == 0xF055)
+			{
+				const uint16_t length = (opcode & 0xF0FF) == 0xF033 ? 3 : ((opcode & 0x0F00) >> 8) + 1;
+				ChipEmitter::invalidateWrite(writeStart, writeStart + length - 1);
+			}
+		}
+		while (executed < budget && executed < static_cast<int64_t>(BLOCK_MAX_INSTR) && !isFlow(opcode));
+
+		return executed;
+	}
+
+	// upper bound for the code of one block, 2 * BLOCK_MAX_INSTR 15-row sprites (in a block compiled with its profile)
+	// take about 160 KiB.
+	static constexpr size_t MAX_BLOCK_SIZE = 192 * 1024;
+
+	// the cache after the dispatcher is split into regions that are filled one at a time. once the current region
+	// is full, the one with the least live code (invalidated blocks are dead) is evicted and reused, the oldest on a tie.
+	// blocks dropped with it are recompiled into the new region on their next miss, so the hot ones move forward
+	// instead of the whole cache being flushed and recompiled.
+	static constexpr int CACHE_REGIONS = 8;
+	static constexpr size_t REGION_SIZE = (ChipEmitter::MAX_CACHE_SIZE - 64 * 1024) / CACHE_REGIONS; // 64 KiB for the dispatcher
+
+	static_assert(REGION_SIZE > 2 * MAX_BLOCK_SIZE);
+
+	std::array<uint32_t, CACHE_REGIONS> regionAge{}; // generation the region was last filled in, 0 if never used
+	uint32_t generation{ 0 };
+	int region{ 0 };
+
+	inline size_t regionStart(int index) const { return c.getDispatcherSize() + index * REGION_SIZE; }
+
+	// once a region was reused the filled ones can lie past the emit position.
+	inline size_t usedCodeEnd() const
+	{
+		size_t end = c.getCodeSize();
+
+		for (int i = region + 1; i < CACHE_REGIONS; i++)
+		{
+			if (regionAge[i] != 0) end = regionStart(i + 1);
+		}
+
+		return end;
+	}
+
+	// a counted copy can be compiled right after its block, so there's always room left for two.
+	inline bool hasRoom() const
+	{
+		return c.getCodeSize() + 2 * MAX_BLOCK_SIZE <= regionStart(region + 1);
+	}
+
+	inline void reserveCode()
+	{
+		if (hasRoom()) [[likely]]
+			return;
+
+		regionAge[region] = ++generation;
+
+		std::array<size_t, CACHE_REGIONS> live{};
+
+		for (const auto& block : JIT.blocks)
+		{
+			if (JIT.blockEntries[block.startPC] != nullptr)
+				live[(block.cacheOffset - c.getDispatcherSize()) / REGION_SIZE] += block.cacheSize;
+		}
+
+		int victim { -1 };
+
+		for (int i = 0; i < CACHE_REGIONS; i++)
+		{
+			if (i != region && (victim == -1 || live[i] < live[victim] || (live[i] == live[victim] && regionAge[i] < regionAge[victim])))
+				victim = i;
+		}
+
+		evictRegion(victim);
+		region = victim;
+		c.setCodeSize(regionStart(region));
+	}
+
+	// nothing points into the region afterwards. only called between blocks, none of its code is running.
+	void evictRegion(int index)
+	{
+		const uint8_t* begin = c.getCodePtr() + regionStart(index);
+		const uint8_t* end = begin + REGION_SIZE;
+
+		const auto inRegion = [=](const uint8_t* code) { return code >= begin && code < end; };
+
+		for (int16_t i = 0; i < static_cast<int16_t>(JIT.blocks.size()); i++)
+		{
+			if (inRegion(JIT.blockEntries[JIT.blocks[i].startPC]))
+				ChipEmitter::dropBlock(i);
+		}
+
+		for (auto& entry : JIT.countedEntries)
+		{
+			if (inRegion(entry)) entry = nullptr;
+		}
+
+		for (auto& links : JIT.blockLinks)
+			std::erase_if(links, inRegion);
+
+		for (auto& entry : JIT.shadowStack)
+		{
+			if (inRegion(entry.code)) entry = ShadowReturn{};
+		}
+
+		// sites of counted copies, their block can outlive them.
+		for (auto& cache : JIT.inlineCaches)
+		{
+			if (inRegion(cache.stubs[0])) cache = InlineCache{};
+		}
+
+		std::erase_if(JIT.relocations, [&](const CodeRelocation& relocation) {
+			return inRegion(c.getCodePtr() + relocation.offset);
+		});
+	}
+
+	// the PCs the block exits to are added to exits if given. the block is emitted without touching the tables compiled
+	// code uses, only publishing it takes JIT.mutex. returns nullptr if the guest stored to its code in the meantime.
+	inline const uint8_t* compileBlock(uint16_t pc, std::vector<uint16_t>* exits = nullptr)
+	{
+		reserveCode();
+
+		cacheChanged = true;
+		compilePC = pc;
+
+		JITBlock block{ pc };
+
+		c.alignBlock();
+		block.cacheOffset = static_cast<uint32_t>(c.getCodeSize());
+
+		optimizing = JIT.hotBlocks[pc];
+		c.profiling = profileGuided && !optimizing;
+		blockLimit = optimizing ? 2 * BLOCK_MAX_INSTR : BLOCK_MAX_INSTR;
+
+		size_t entry { block.cacheOffset };
+		block.baseline = useBaseline(pc) && decodeBaseline();
+
+		if (block.baseline)
+		{
+			entry = c.copyEntry(pc);
+			copyBlock();
+			JIT.entryCounters[pc] = BASELINE_ENTRIES;
+		}
+		else
+		{
+			compilePC = pc;
+			emitBlock();
+		}
+
+		c.finishBlock();
+
+		optimizing = c.profiling = false;
+		blockLimit = BLOCK_MAX_INSTR;
+
+		ranges.back().end = compilePC;
+		block.ranges = ranges;
+		block.ranges.insert(block.ranges.end(), c.getDataRanges().begin(), c.getDataRanges().end());
+		block.exits = c.getExitPCs();
+		block.cacheSize = static_cast<uint32_t>(c.getCodeSize() - block.cacheOffset);
+
+		if (exits != nullptr)
+			exits->insert(exits->end(), c.getExitPCs().begin(), c.getExitPCs().end());
+
+		const uint8_t* code = c.getCodePtr() + entry;
+
+		{
+			std::lock_guard lock{ JIT.mutex };
+
+			auto& map = JIT.blockMap[pc];
+
+			if (map.block == -1) [[likely]]
+			{
+				map.block = JIT.blocks.size();
+				JIT.blocks.push_back(std::move(block));
+			}
+			else
+				JIT.blocks[map.block] = std::move(block);
+
+			JIT.addBlockLines(map.block);
+
+			if (isStale(JIT.blocks[map.block]))
+			{
+				JIT.removeBlockLines(map.block);
+				code = nullptr;
+			}
+			else
+			{
+				c.publishBlock(map.block);
+				JIT.storeEntry(pc, code);
+				c.linkBlock(pc, code);
+			}
+		}
+
+		c.resetState();
+		return code;
+	}
+
+	// whether the guest stored to the code of a block compiled on the compiler thread since RAM was copied. a store
+	// made later sees the lines marked, and invalidates the block once it's published.
+	inline bool isStale(const JITBlock& block) const
+	{
+		if (c.codeRAM == s.RAM.data()) return false;
+
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+
+		return std::any_of(block.ranges.begin(), block.ranges.end(), [&](const JITRange& range) {
+			for (int addr = range.start; addr < range.end; addr++)
+			{
+				if (c.codeRAM[addr & 0xFFF] != s.RAM[addr & 0xFFF]) return true;
+			}
+			return false;
+		});
+	}
+
+	// the counted copy covers the same instructions as the block at pc, so it's invalidated together with it.
+	const uint8_t* getCountedBlock(uint16_t pc)
+	{
+		if (JIT.countedEntries[pc] != nullptr) [[likely]]
+			return JIT.countedEntries[pc];
+
+		cacheChanged = true;
+
+		reserveCode();
+
+		// invalidation goes through the block's ranges, so the copy needs a valid block compiled from the same code.
+		if (JIT.blockEntries[pc] == nullptr)
+			compileBlock(pc);
+
+		c.alignBlock();
+		const size_t offset = c.getCodeSize();
+
+		compilePC = pc;
+		c.counted = true;
+
+		emitBlock();
+		c.finishBlock();
+
+		auto& block = JIT.blocks[JIT.blockMap[pc].block];
+		block.ranges.insert(block.ranges.end(), c.getDataRanges().begin(), c.getDataRanges().end());
+
+		// the copy is emitted from code the baseline block doesn't cover, it jumps and inlines calls.
+		if (block.baseline)
+		{
+			ranges.back().end = compilePC;
+			block.ranges.insert(block.ranges.end(), ranges.begin(), ranges.end());
+		}
+		JIT.addBlockLines(JIT.blockMap[pc].block);
+		c.publishBlock(JIT.blockMap[pc].block);
+
+		c.resetState();
+		c.counted = false;
+
+		return JIT.countedEntries[pc] = c.getCodePtr() + offset;
+	}
+
+	// guest code covered by the block being emitted, the last range is still open.
+	std::vector<JITRange> ranges{};
+	uint16_t compilePC{ 0 }; // end of the open range
+
+	inline bool inBlock(uint16_t pc) const
+	{
+		return std::any_of(ranges.begin(), ranges.end() - 1, [=](const JITRange& range) { return pc >= range.start && pc < range.end; }) ||
+			(pc >= ranges.back().start && pc < compilePC);
+	}
+
+	// return addresses of the calls inlined into the block being emitted.
+	std::vector<uint16_t> inlinedCalls{};
+
+	// the block being compiled, decoded up front so registers can be allocated over all of it.
+	std::vector<DecodedInstr> decoded{};
+	uint64_t blockLimit{ BLOCK_MAX_INSTR };
+
+	// set while compiling a hot block with its profile: it's decoded up to twice as far, and skips ending it
+	// fall through to the exit that was taken more often.
+	bool optimizing{ false };
 
-				ud_set_input_buffer(&ud_obj, c.getCodePtr() + block.cacheOffset, block.cacheSize);
+	// continues decoding at target, in a new range of the block.
+	bool follow(uint16_t target)
+	{
+		if (decoded.size() >= blockLimit)
+			return false;
 
-				while (ud_disassemble(&ud_obj))
-					outFile << ud_insn_asm(&ud_obj) << "\n";
+		ranges.back().end = compilePC;
+		ranges.push_back(JITRange{ static_cast<uint16_t>(target & 0xFFF), static_cast<uint16_t>(target & 0xFFF) });
+		compilePC = target & 0xFFF;
 
-				outFile << "\n";
-			}
-		}
+		return true;
 	}
-private:
-	ud_t ud_obj;
-	bool udInitialized{ false };
-
-private:
-	ChipEmitter c{};
 
-	static constexpr uint64_t BLOCK_MAX_INSTR = 64;
-	uint64_t instructionsPerBlock { 1 };
+	// superblocks: jumps to code not in the block yet are laid out inline while there's room left.
+	inline bool followJump(uint16_t target)
+	{
+		return !inBlock(target & 0xFFF) && follow(target);
+	}
 
-	void initialize() override
+	// calls are inlined even if the callee is already in the block (a helper called repeatedly),
+	// the matching 00EE then continues at the known return address. only leaves that fit in the block whole are,
+	// other calls end it.
+	inline bool followCall(uint16_t target, uint16_t returnPC)
 	{
-		s.reset();
-		clearJITCache();
+		const uint64_t size = leafSize(target);
+
+		if (size == 0 || decoded.size() + size > blockLimit || !follow(target))
+			return false;
+
+		inlinedCalls.push_back(returnPC);
+		return true;
 	}
 
-	inline uint64_t compileBlock()
+	inline bool followReturn()
 	{
-		constexpr size_t CACHE_CLEAR_THRESHOLD = static_cast<size_t>(ChipEmitter::MAX_CACHE_SIZE * 0.9);
+		if (inlinedCalls.empty() || !follow(inlinedCalls.back()))
+			return false;
 
-		if (c.getCodeSize() >= CACHE_CLEAR_THRESHOLD) [[unlikely]]
-			clearJITCache();
+		inlinedCalls.pop_back();
+		return true;
+	}
 
-		s.pc &= 0xFFF;
-		auto& map = JIT.blockMap[s.pc];
-		map.isValid = true;
+	// instructions of the callee at pc up to its return, 0 if it isn't a leaf of at most CALL_INLINE_MAX_INSTR: it
+	// calls, jumps or waits for a key first, or it stores to RAM, which could rewrite the caller while it runs.
+	// a skipped 00EE doesn't end it.
+	uint64_t leafSize(uint16_t pc) const
+	{
+		bool skipped { false };
 
-		if (map.block == -1) [[likely]]
+		for (uint64_t size = 1; size <= CALL_INLINE_MAX_INSTR; size++, pc += 2)
 		{
-			map.block = JIT.blocks.size();
-			JIT.blocks.push_back(JITBlock{ s.pc });
-		}
-
-		auto& block = JIT.blocks[map.block];
-		block.cacheOffset = static_cast<uint32_t>(c.getCodeSize());
+			const uint16_t opcode = fetch(pc);
 
-		analyzeBlock();
-		emitBlock();
-		c.emitEpilogue();
+			switch (opcode & 0xF000)
+			{
+			case 0x0000:
+				if (opcode == 0x00EE && !skipped) return size;
+				break;
+			case 0x1000:
+			case 0x2000:
+			case 0xB000:
+				return 0;
+			case 0xF000:
+				if ((opcode & 0x00FF) == 0x000A || (opcode & 0x00FF) == 0x0033 || (opcode & 0x00FF) == 0x0055)
+					return 0;
+				break;
+			}
 
-		s.pc &= 0xFFF;
-		block.endPC = s.pc;
-		block.cacheSize = static_cast<uint32_t>(c.getCodeSize() - block.cacheOffset);
+			skipped = isSkip(opcode);
+		}
 
-		return c.execute(block.cacheOffset);
+		return 0;
 	}
 
-	bool isFlowNext(uint16_t pc)
+	// a skip at the instruction limit can't jump over the next instruction either.
+	inline bool skipEndsBlock()
 	{
-		const uint16_t opcode = (s.RAM[pc & 0xFFF] << 8) | s.RAM[(pc + 1) & 0xFFF];
+		return decoded.size() >= blockLimit || isFlow(fetch(compilePC));
+	}
 
+	// instructions that don't always continue at the next one.
+	static bool isFlow(uint16_t opcode)
+	{
 		switch (opcode & 0xF000)
 		{
 		case 0x0000:
@@ -137,334 +1108,572 @@ private:
 		case 0x2000:
 		case 0xB000:
 			return true;
+		// a skip label can't be nested in another skip, or placed after an instruction that ends the block.
+		case 0x3000:
+		case 0x4000:
+		case 0x5000:
+		case 0x9000:
+		case 0xE000:
+			return true;
+		case 0xF000:
+			return (opcode & 0x00FF) == 0x000A;
 		default:
 			return false;
 		}
 	}
 
-	void analyzeBlock()
+	inline uint16_t fetch(uint16_t pc) const
 	{
-		uint16_t pc = s.pc;
+		return (c.codeRAM[pc & 0xFFF] << 8) | c.codeRAM[(pc + 1) & 0xFFF];
+	}
 
-		for (int i = 0; i < instructionsPerBlock; i++)
+	static inline bool isSkip(uint16_t opcode)
+	{
+		switch (opcode & 0xF000)
 		{
-			const uint16_t opcode = (s.RAM[pc & 0xFFF] << 8) | s.RAM[(pc + 1) & 0xFFF];
-			const uint8_t xReg = ((opcode & 0x0F00) >> 8) & 0xF;
-			const uint8_t yReg = ((opcode & 0x00F0) >> 4) & 0xF;
+		case 0x3000:
+		case 0x4000:
+			return true;
+		case 0x5000:
+		case 0x9000:
+			return (opcode & 0x000F) == 0;
+		case 0xE000:
+			return (opcode & 0x00FF) == 0x009E || (opcode & 0x00FF) == 0x00A1;
+		default:
+			return false;
+		}
+	}
 
-			pc += 2;
+	// V registers an instruction reads and writes, as the emitter accesses them.
+	static void decodeRegAccess(DecodedInstr& instr)
+	{
+		const uint16_t x = 1 << ((instr.opcode & 0x0F00) >> 8);
+		const uint16_t y = 1 << ((instr.opcode & 0x00F0) >> 4);
+		const uint16_t flag = 1 << 0xF;
 
-			switch (opcode & 0xF000)
+		switch (instr.opcode & 0xF000)
+		{
+		case 0x3000:
+		case 0x4000:
+		case 0xE000:
+			instr.uses = x;
+			break;
+		case 0x5000:
+		case 0x9000:
+			instr.uses = x | y;
+			break;
+		case 0x6000:
+		case 0xC000:
+			instr.defs = x;
+			break;
+		case 0x7000:
+			instr.uses = instr.defs = x;
+			break;
+		case 0x8000:
+			switch (instr.opcode & 0x000F)
 			{
 			case 0x0000:
-				switch (opcode & 0x0FFF)
-				{
-				case 0x00EE:
-					return;
-				}
+				instr.uses = y;
+				instr.defs = x;
 				break;
-			case 0x1000:
-			case 0x2000:
-				return;
-
-			case 0x3000:
-			case 0x4000:
-			case 0x5000:
-			case 0xE000:
-				c.VRegUsage[xReg]++;
-				if (isFlowNext(pc)) return;
-				c.incrementBranches();
-				break;
-			case 0x6000:
-			case 0x7000:
-			case 0xC000:
-				c.VRegUsage[xReg]++;
-				break;
-			case 0x8000:
-				switch (opcode & 0x000F)
-				{
-				case 0x0000:
-				case 0x0001:
-				case 0x0002:
-				case 0x0003:
-					c.VRegUsage[xReg]++;
-					c.VRegUsage[yReg]++;
-					if (Quirks::VFReset) c.VRegUsage[0xF]++;
-					break;
-				case 0x0004:
-				case 0x0005:
-				case 0x0007:
-					c.VRegUsage[xReg]++;
-					c.VRegUsage[yReg]++;
-					c.VRegUsage[0xF]++;
-					break;
-
-				case 0x0006:
-				case 0x000E:
-					c.VRegUsage[xReg]++;
-					c.VRegUsage[0xF]++;
-					break;
-				}
+			case 0x0001:
+			case 0x0002:
+			case 0x0003:
+				instr.uses = x | y;
+				instr.defs = x | (Quirks::VFReset ? flag : 0);
 				break;
-			case 0x9000:
-				c.VRegUsage[xReg]++;
-				c.VRegUsage[yReg]++;
-				if (isFlowNext(pc)) return;
-				c.incrementBranches();
+			case 0x0004:
+			case 0x0005:
+			case 0x0006:
+			case 0x0007:
+			case 0x000E:
+				instr.uses = x | y;
+				instr.defs = x | flag;
 				break;
-			case 0xA000:
-				c.IRegUsage++;
+			}
+			break;
+		case 0xB000:
+			instr.uses = x | 1;
+			break;
+		case 0xD000:
+			instr.uses = x | y;
+			instr.defs = flag;
+			break;
+		case 0xF000:
+			switch (instr.opcode & 0x00FF)
+			{
+			case 0x0007:
+				instr.defs = x;
 				break;
-			case 0xB000:
-				c.VRegUsage[(Quirks::Jumping ? xReg : 0)]++;
+			case 0x000A:
+				instr.uses = instr.defs = x;
 				break;
-			case 0xD000:
-				c.VRegUsage[xReg]++; 
-				c.VRegUsage[yReg]++; 
-				c.VRegUsage[0xF] += (opcode & 0x000F); // height
-				c.IRegUsage += (opcode & 0x000F);
+			case 0x0015:
+			case 0x0018:
+			case 0x001E:
+			case 0x0029:
+			case 0x0033:
+				instr.uses = x;
 				break;
-			case 0xF000:
-				switch (opcode & 0x00FF)
-				{
-				case 0x0007:
-				case 0x0015:
-				case 0x0018:
-					c.VRegUsage[xReg]++;
-					break;
-				case 0x000A:
-					return;
-				case 0x001E:
-				case 0x0029:
-				case 0x0033:
-					c.IRegUsage++;
-					c.VRegUsage[xReg]++;
-					break;
-				case 0x0055:
-				case 0x0065:
-					c.IRegUsage++;
-
-					for (int i = 0; i <= xReg; i++)
-						c.VRegUsage[i]++;
-
-					if ((opcode & 0x00FF) == 0x0055) return;
-					break;
-				}
+			case 0x0055:
+				instr.uses = (x << 1) - 1;
+				break;
+			case 0x0065:
+				instr.defs = (x << 1) - 1;
 				break;
 			}
+			break;
 		}
 	}
 
-	void emitBlock()
+	void decodeBlock()
 	{
-		c.allocateRegs();
-		c.emitPrologue();
+		ranges.clear();
+		ranges.push_back(JITRange{ compilePC, compilePC });
+		inlinedCalls.clear();
+		decoded.clear();
 
 		bool condition { false };
 
-		while (c.instructions < instructionsPerBlock || condition)
+		while (decoded.size() < blockLimit || condition)
 		{
-			const uint16_t opcode = (s.RAM[s.pc & 0xFFF] << 8) | s.RAM[(s.pc + 1) & 0xFFF];
+			const uint16_t opcode = fetch(compilePC);
 
-			const uint8_t xOperand = ((opcode & 0x0F00) >> 8) & 0xF;
-			const uint8_t yOperand = ((opcode & 0x00F0) >> 4) & 0xF;
-			const uint8_t value = opcode & 0x00FF;
+			decoded.push_back(DecodedInstr{ compilePC, opcode });
+			decodeRegAccess(decoded.back());
+			compilePC += 2;
 
-			s.pc += 2;
-			c.instructions++;
+			Flow flow { Flow::Next };
 
 			switch (opcode & 0xF000)
 			{
 			case 0x0000:
+				if (opcode == 0x00EE)
+					flow = followReturn() ? Flow::Return : Flow::Exit;
+				break;
+			case 0x1000:
+				flow = followJump(opcode & 0xFFF) ? Flow::Jump : Flow::Exit;
+				break;
+			case 0x2000:
+				flow = followCall(opcode & 0xFFF, compilePC) ? Flow::Call : Flow::Exit;
+				break;
+			case 0xB000:
+				flow = Flow::Exit;
+				break;
+			case 0xF000:
+				// stores continue the block, they leave it themselves when it gets invalidated.
+				if ((opcode & 0x00FF) == 0x000A)
+					flow = Flow::Exit;
+				break;
+			}
+
+			if (isSkip(opcode))
+				flow = skipEndsBlock() ? Flow::SkipExit : Flow::Skip;
+
+			decoded.back().flow = flow;
+
+			switch (flow)
+			{
+			case Flow::Exit:
+				return;
+			case Flow::SkipExit:
 			{
-				switch (opcode & 0x0FFF)
+				// a jump or call that isn't skipped is run by the skip's exit.
+				const uint16_t next = fetch(compilePC);
+
+				if (!c.counted && ((next & 0xF000) == 0x1000 || (next & 0xF000) == 0x2000))
 				{
-				case 0x00E0:
-					c.emit00E0();
-					break;
-				case 0x00EE:
-					c.emit00EE();
-					return;
+					decoded.push_back(DecodedInstr{ compilePC, next, Flow::Folded });
+					compilePC += 2; // the block covers it now.
 				}
+				return;
+			}
+			case Flow::Skip:
+				condition = true;
+				break;
+			default:
+				condition = false;
 				break;
 			}
-			case 0x1000:
+		}
+	}
+
+	// backward liveness of VF over the decoded block. VF is live at every exit, which in counted copies
+	// is before any instruction, and a skipped instruction may not overwrite it.
+	void markDeadFlags()
+	{
+		if (c.counted) return;
+
+		constexpr uint16_t flag = 1 << 0xF;
+		bool live { true };
+
+		for (size_t i = decoded.size(); i-- > 0;)
+		{
+			auto& instr = decoded[i];
+			const bool liveAfter = live;
+
+			instr.flagDead = (instr.defs & flag) && !liveAfter;
+			live = (instr.uses & flag) || (liveAfter && !(instr.defs & flag));
+
+			// a store can leave the block when it invalidates it.
+			if ((instr.opcode & 0xF0FF) == 0xF055 || (instr.opcode & 0xF0FF) == 0xF033)
+				live = true;
+
+			if (i > 0 && decoded[i - 1].flow == Flow::Skip)
+				live = live || liveAfter;
+		}
+	}
+
+	// both outcomes of a skip ending the block get a linkable exit, unless the outcome is known.
+	void emitSkipExits(size_t index, int known)
+	{
+		const uint16_t skipPC = decoded[index].pc;
+		const uint16_t nextPC = skipPC + 2;
+		const uint64_t takenExecuted = c.executed();
+
+		if (known == 1)
+		{
+			c.emitLinkedEpilogue(nextPC + 2);
+			return;
+		}
+
+		const bool inverted = c.invertSkip;
+		c.invertSkip = false;
+
+		if (inverted)
+		{
+			c.emitLinkedEpilogue(nextPC + 2, takenExecuted);
+			c.emitSkipLabel();
+		}
+
+		if (known == -1)
+			c.emitSkipCount(skipPC, false);
+
+		if (index + 1 < decoded.size())
+		{
+			const uint16_t opcode = decoded[index + 1].opcode;
+			c.instructions++;
+
+			if ((opcode & 0xF000) == 0x1000)
 				c.emit1NNN(opcode & 0xFFF);
+			else
+				c.emit2NNN(opcode & 0xFFF, nextPC + 2);
+		}
+		else
+			c.emitLinkedEpilogue(nextPC);
+
+		if (known == -1 && !inverted)
+			c.emitSkipTaken(nextPC + 2, takenExecuted, skipPC);
+	}
+
+	// the tiered mode's interpreter is the first tier there already, hot blocks skip it.
+	inline bool useBaseline(uint16_t pc) const
+	{
+		return baselineTier && !tiered && !JIT.warmBlocks[pc] && !JIT.hotBlocks[pc] && c.hasStencils();
+	}
+
+	// straight-line decoding for a baseline block, it ends at the first jump, call, return or store. returns false
+	// if an instruction has no stencil.
+	bool decodeBaseline()
+	{
+		ranges.clear();
+		ranges.push_back(JITRange{ compilePC, compilePC });
+		decoded.clear();
+
+		bool condition { false };
+
+		while (decoded.size() < blockLimit || condition)
+		{
+			const uint16_t opcode = fetch(compilePC);
+			if (!c.hasStencil(opcode)) return false;
+
+			decoded.push_back(DecodedInstr{ compilePC, opcode });
+			compilePC += 2;
+
+			Flow flow { Flow::Next };
+
+			if (opcode == 0x00EE || (opcode & 0xF000) == 0x1000 || (opcode & 0xF000) == 0x2000 || (opcode & 0xF000) == 0xB000)
+				flow = Flow::Exit;
+			else if (isSkip(opcode))
+				flow = skipEndsBlock() ? Flow::SkipExit : Flow::Skip;
+
+			decoded.back().flow = flow;
+
+			if (flow == Flow::Exit || flow == Flow::SkipExit)
+				return true;
+
+			// the stencils of stores don't leave the block when they invalidate it.
+			if ((opcode & 0xF0FF) == 0xF055 || (opcode & 0xF0FF) == 0xF033)
+				return true;
+
+			condition = flow == Flow::Skip;
+		}
+
+		return true;
+	}
+
+	void copyBlock()
+	{
+		size_t skipAt { 0 };
+		uint16_t skipOpcode { 0 };
+		bool skipLabel { false };
+
+		for (const auto& instr : decoded)
+		{
+			c.instructions++;
+			const size_t at = c.copyInstr(instr.pc, instr.opcode);
+
+			switch (instr.flow)
+			{
+			case Flow::Exit:
 				return;
-			case 0x2000:
-				c.emit2NNN(opcode & 0xFFF);
+			case Flow::SkipExit:
+				c.copyExit(instr.pc + 2);
+				c.copySkipLabel(at, instr.opcode);
+				c.copyExit(instr.pc + 4);
 				return;
-			case 0x3000:
-				if (isFlowNext(s.pc))
-				{
-					c.emit3XNN<false>(xOperand, value);
-					return;
-				}
-				else
-				{
-					c.emit3XNN<true>(xOperand, value);
-					condition = true;
-					continue;
-				}
-			case 0x4000:
-				if (isFlowNext(s.pc))
+			case Flow::Skip:
+				c.copySkipNotTaken();
+				skipAt = at;
+				skipOpcode = instr.opcode;
+				skipLabel = true;
+				break;
+			default:
+				if (skipLabel)
 				{
-					c.emit4XNN<false>(xOperand, value);
-					return;
+					c.copySkipLabel(skipAt, skipOpcode);
+					skipLabel = false;
 				}
-				else
+				break;
+			}
+		}
+
+		c.copyExit(compilePC);
+	}
+
+	void emitBlock()
+	{
+		const uint16_t startPC = compilePC;
+
+		decodeBlock();
+		markDeadFlags();
+		c.allocateRegs(decoded);
+		c.emitBlockEntry(startPC);
+
+		// skips whose outcome is known from constants only emit the path that's taken.
+		bool skipLabel { false }, skipNext { false };
+
+		for (size_t i = 0; i < decoded.size(); i++)
+		{
+			const auto& instr = decoded[i];
+
+			if (skipNext)
+			{
+				c.beginInstr(i);
+				c.endInstr(i, 0);
+				skipNext = false;
+				continue;
+			}
+
+			const bool isSkip = instr.flow == Flow::Skip || instr.flow == Flow::SkipExit;
+			const int known = isSkip ? c.knownSkip(instr.opcode) : -1;
+
+			c.emitBudgetCheck(instr.pc);
+			c.beginInstr(i);
+
+			// jumps, calls and skip exits write back in their linked epilogues, a back-edge keeps the carried registers.
+			const bool linked = (instr.opcode & 0xF000) == 0x1000 || (instr.opcode & 0xF000) == 0x2000;
+			if (instr.flow == Flow::Exit && !linked)
+				c.emitWriteBack();
+
+			c.instructions++;
+			c.flagDead = instr.flagDead;
+			c.invertSkip = optimizing && instr.flow == Flow::SkipExit && known == -1 && JIT.skipBias[instr.pc] > 0;
+			if (known == -1) emitInstr(instr);
+			c.flagDead = false;
+
+			switch (instr.flow)
+			{
+			case Flow::Exit:
+				return;
+			case Flow::SkipExit:
+				emitSkipExits(i, known);
+				return;
+			case Flow::Skip:
+				if (known == -1)
 				{
-					c.emit4XNN<true>(xOperand, value);
-					condition = true;
-					continue;
+					c.emitSkipNotTaken();
+					skipLabel = true;
 				}
-			case 0x5000:
-				if (isFlowNext(s.pc))
+				skipNext = known == 1;
+				break;
+			default:
+				if (skipLabel)
 				{
-					c.emit5XY0<false>(xOperand, yOperand);
-					return;
+					c.emitJumpLabel();
+					skipLabel = false;
 				}
+				break;
+			}
+
+			c.endInstr(i, instr.defs);
+		}
+
+		c.emitLinkedEpilogue(compilePC);
+	}
+
+	void emitInstr(const DecodedInstr& instr)
+	{
+		const uint16_t opcode = instr.opcode;
+		const uint16_t nextPC = instr.pc + 2;
+
+		const uint8_t xOperand = ((opcode & 0x0F00) >> 8) & 0xF;
+		const uint8_t yOperand = ((opcode & 0x00F0) >> 4) & 0xF;
+		const uint8_t value = opcode & 0x00FF;
+
+		switch (opcode & 0xF000)
+		{
+		case 0x0000:
+		{
+			switch (opcode & 0x0FFF)
+			{
+			case 0x00E0:
+				c.emit00E0();
+				break;
+			case 0x00EE:
+				if (instr.flow == Flow::Return)
+					c.emitPopReturn();
 				else
-				{
-					c.emit5XY0<true>(xOperand, yOperand);
-					condition = true;
-					continue;
-				}
-			case 0x6000:
-				c.emit6XNN(xOperand, value);
+					c.emit00EE();
 				break;
-			case 0x7000:
-				c.emit7XNN(xOperand, value);
+			}
+			break;
+		}
+		case 0x1000:
+			if (instr.flow == Flow::Exit)
+				c.emit1NNN(opcode & 0xFFF);
+			break;
+		case 0x2000:
+			if (instr.flow == Flow::Call)
+				c.emitPushReturn(nextPC);
+			else
+				c.emit2NNN(opcode & 0xFFF, nextPC);
+			break;
+		case 0x3000:
+			c.emit3XNN(xOperand, value);
+			break;
+		case 0x4000:
+			c.emit4XNN(xOperand, value);
+			break;
+		case 0x5000:
+			switch (opcode & 0x000F)
+			{
+			case 0x0000:
+				c.emit5XY0(xOperand, yOperand);
 				break;
-			case 0x8000:
-				switch (opcode & 0x000F)
-				{
-				case 0x0000:
-					c.emit8XY0(xOperand, yOperand);
-					break;
-				case 0x0001:
-					c.emit8XY1(xOperand, yOperand);
-					break;
-				case 0x0002:
-					c.emit8XY2(xOperand, yOperand);
-					break;
-				case 0x0003:
-					c.emit8XY3(xOperand, yOperand);
-					break;
-				case 0x0004:
-					c.emit8XY4(xOperand, yOperand);
-					break;
-				case 0x0005:
-					c.emit8XY5(xOperand, yOperand);
-					break;
-				case 0x0006:
-					c.emit8XY6(xOperand, yOperand);
-					break;
-				case 0x0007:
-					c.emit8XY7(xOperand, yOperand);
-					break;
-				case 0x000E:
-					c.emit8XYE(xOperand, yOperand);
-					break;
-				}
+			}
+			break;
+		case 0x6000:
+			c.emit6XNN(xOperand, value);
+			break;
+		case 0x7000:
+			c.emit7XNN(xOperand, value);
+			break;
+		case 0x8000:
+			switch (opcode & 0x000F)
+			{
+			case 0x0000:
+				c.emit8XY0(xOperand, yOperand);
 				break;
-			case 0x9000:
-				switch (opcode & 0x000F)
-				{
-				case 0x0000:
-					if (isFlowNext(s.pc))
-					{
-						c.emit9XY0<false>(xOperand, yOperand);
-						return;
-					}
-					else
-					{
-						c.emit9XY0<true>(xOperand, yOperand);
-						condition = true;
-						continue;
-					}
-				}
+			case 0x0001:
+				c.emit8XY1(xOperand, yOperand);
 				break;
-			case 0xA000:
-				c.emitANNN(opcode & 0xFFF);
+			case 0x0002:
+				c.emit8XY2(xOperand, yOperand);
 				break;
-			case 0xB000:
-				c.emitBNNN(opcode & 0xFFF, xOperand);
-				return;
-			case 0xC000:
-				c.emitCXNN(xOperand, value);
+			case 0x0003:
+				c.emit8XY3(xOperand, yOperand);
 				break;
-			case 0xD000:
-				c.emitDXYN(xOperand, yOperand, opcode & 0x000F);
+			case 0x0004:
+				c.emit8XY4(xOperand, yOperand);
 				break;
-			case 0xE000:
-				switch (opcode & 0x00FF)
-				{
-				case 0x009E:
-					if (isFlowNext(s.pc))
-					{
-						c.emitEX9E<false>(xOperand);
-						return;
-					}
-					else
-					{
-						c.emitEX9E<true>(xOperand);
-						condition = true;
-						continue;
-					}
-				case 0x00A1:
-					if (isFlowNext(s.pc))
-					{
-						c.emitEXA1<false>(xOperand);
-						return;
-					}
-					else
-					{
-						c.emitEXA1<true>(xOperand);
-						condition = true;
-						continue;
-					}
-				}
+			case 0x0005:
+				c.emit8XY5(xOperand, yOperand);
 				break;
-			case 0xF000:
-				switch (opcode & 0x00FF)
-				{
-				case 0x0007:
-					c.emitFX07(xOperand);
-					break;
-				case 0x000A:
-					c.emitFX0A(xOperand);
-					return;
-				case 0x001E:
-					c.emitFX1E(xOperand);
-					break;
-				case 0x0015:
-					c.emitFX15(xOperand);
-					break;
-				case 0x0018:
-					c.emitFX18(xOperand);
-					break;
-				case 0x0029:
-					c.emitFX29(xOperand);
-					break;
-				case 0x0033:
-					c.emitFX33(xOperand);
-					break;
-				case 0x0055:
-					c.emitFX55(xOperand);
-					return; // ending the block on memory store, because self-modifying code can modify the current block.
-				case 0x0065:
-					c.emitFX65(xOperand); 
-					break;
-				}
+			case 0x0006:
+				c.emit8XY6(xOperand, yOperand);
+				break;
+			case 0x0007:
+				c.emit8XY7(xOperand, yOperand);
+				break;
+			case 0x000E:
+				c.emit8XYE(xOperand, yOperand);
 				break;
 			}
-
-			if (condition)
+			break;
+		case 0x9000:
+			switch (opcode & 0x000F)
 			{
-				c.emitJumpLabel();
-				condition = false;
+			case 0x0000:
+				c.emit9XY0(xOperand, yOperand);
+				break;
+			}
+			break;
+		case 0xA000:
+			c.emitANNN(opcode & 0xFFF);
+			break;
+		case 0xB000:
+			c.emitBNNN(opcode & 0xFFF, xOperand);
+			break;
+		case 0xC000:
+			c.emitCXNN(xOperand, value);
+			break;
+		case 0xD000:
+			c.emitDXYN(xOperand, yOperand, opcode & 0x000F);
+			break;
+		case 0xE000:
+			switch (opcode & 0x00FF)
+			{
+			case 0x009E:
+				c.emitEX9E(xOperand);
+				break;
+			case 0x00A1:
+				c.emitEXA1(xOperand);
+				break;
+			}
+			break;
+		case 0xF000:
+			switch (opcode & 0x00FF)
+			{
+			case 0x0007:
+				c.emitFX07(xOperand);
+				break;
+			case 0x000A:
+				c.emitFX0A(xOperand, nextPC);
+				break;
+			case 0x001E:
+				c.emitFX1E(xOperand);
+				break;
+			case 0x0015:
+				c.emitFX15(xOperand);
+				break;
+			case 0x0018:
+				c.emitFX18(xOperand);
+				break;
+			case 0x0029:
+				c.emitFX29(xOperand);
+				break;
+			case 0x0033:
+				c.emitFX33(xOperand, nextPC);
+				break;
+			case 0x0055:
+				c.emitFX55(xOperand, nextPC);
+				break;
+			case 0x0065:
+				c.emitFX65(xOperand); 
+				break;
 			}
+			break;
 		}
 	}
-};
\ No newline at end of file
+};
@@ -1,16 +1,40 @@
 #pragma once
 
 #include <vector>
+#include <array>
+#include <algorithm>
+#include <atomic>
+#include <mutex>
 #include "ChipState.h"
 
+// guest addresses [start, end) compiled into a block, end can go past the end of RAM.
+struct JITRange
+{
+	uint16_t start{};
+	uint16_t end{};
+
+	// last is inclusive, both ranges may wrap around the end of RAM.
+	inline bool overlaps(uint16_t first, uint16_t last) const
+	{
+		constexpr int RAM_SIZE = ChipState::RAM_SIZE;
+
+		return (start <= last && end > first) ||
+			(start + RAM_SIZE <= last && end + RAM_SIZE > first) ||
+			(start <= last + RAM_SIZE && end > first + RAM_SIZE);
+	}
+};
+
 struct JITBlock
 {
 	uint16_t startPC{};
-	uint16_t endPC{};
+	std::vector<JITRange> ranges{}; // more than one when the block follows jumps.
 
 	uint32_t cacheSize{};
 	uint32_t cacheOffset{};
 
+	std::vector<uint16_t> exits{}; // PCs its exit stubs jump to
+	bool baseline{ false }; // copied from stencils, see ChipEmitter::buildStencils()
+
 	JITBlock(uint16_t startPC) : startPC(startPC) 
 	{
 	}
@@ -18,18 +42,210 @@ struct JITBlock
 
 struct JITMapEntry
 {
-	bool isValid { false };
 	int16_t block{ -1 };
 };
 
+// how an instruction of a decoded block continues.
+enum class Flow : uint8_t
+{
+	Next,
+	Jump,     // 1NNN followed into the block
+	Call,     // 2NNN inlined into the block
+	Return,   // 00EE of an inlined call
+	Skip,     // skip over the next instruction of the block
+	SkipExit, // skip with an exit for both outcomes, ends the block
+	Folded,   // 1NNN or 2NNN run by the preceding skip exit
+	Exit
+};
+
+struct DecodedInstr
+{
+	uint16_t pc{};
+	uint16_t opcode{};
+	Flow flow{ Flow::Next };
+
+	// V registers read and written, one bit per register.
+	uint16_t uses{};
+	uint16_t defs{};
+
+	bool flagDead{ false }; // the VF written here is overwritten before it's read.
+};
+
+// the guest return PC pushed by a compiled 2NNN, and the exit stub of its call site that links to the return block.
+struct ShadowReturn
+{
+	uint16_t pc{ 0xFFFF };
+	const uint8_t* code{ nullptr };
+};
+
+// patchable compare and exit stub slots of a BNNN site.
+struct InlineCache
+{
+	static constexpr int SLOTS = 4;
+	static constexpr uint16_t EMPTY = 0x7FFF; // not a masked PC, and still encoded as imm16
+
+	std::array<uint8_t*, SLOTS> targets{}; // imm16 of each slot's compare
+	std::array<uint8_t*, SLOTS> stubs{};
+	uint8_t next{ 0 };
+
+	int16_t block{ -1 }; // index into blocks of the block holding the site, -1 while the entry is free
+};
+
+// absolute addresses in block code, patched with this process' addresses when code is loaded from a cache file.
+enum class CodeAddress : uint8_t
+{
+	CodeLines,
+	ShadowStack,
+	InvalidateBlocks,
+	UpdateInlineCache,
+	EntryCounters,
+	SkipBias,
+	PromoteBlock,
+	TierUpBlock
+};
+
+constexpr uint8_t CODE_ADDRESSES = static_cast<uint8_t>(CodeAddress::TierUpBlock) + 1; // keep TierUpBlock last
+
+struct CodeRelocation
+{
+	uint32_t offset{}; // of the imm64 in the code cache
+	CodeAddress target{};
+};
+
 struct ChipJITState
 {
 	std::array<JITMapEntry, ChipState::RAM_SIZE> blockMap{};
 	std::vector<JITBlock> blocks{};
 
+	// held while the tables are changed outside of the thread running compiled code: the compiler thread of the
+	// tiered mode publishes its blocks under it, so runtime calls from compiled code take it too.
+	std::mutex mutex{};
+
+	// host code of the valid block starting at each guest PC, nullptr sends the dispatcher to the compiler.
+	// published with a release store, compiled code keeps dispatching while the compiler thread adds blocks.
+	std::array<const uint8_t*, ChipState::RAM_SIZE> blockEntries{};
+	std::array<const uint8_t*, ChipState::RAM_SIZE> countedEntries{}; // copies checking the budget per instruction.
+
+	// exit stubs of compiled blocks, grouped by the guest PC they jump to.
+	std::array<std::vector<uint8_t*>, ChipState::RAM_SIZE> blockLinks{};
+
+	std::array<ShadowReturn, 16> shadowStack{}; // indexed like ChipState::stack
+	std::vector<InlineCache> inlineCaches{};
+	std::vector<CodeRelocation> relocations{};
+
+	// RAM is tracked in 16-byte lines: whether a line holds code (or data baked into code), checked inline by
+	// stores, and the blocks covering it, so an invalidation doesn't have to scan all blocks.
+	static constexpr int LINE_SHIFT = 4;
+	static constexpr int LINES = ChipState::RAM_SIZE >> LINE_SHIFT;
+
+	std::array<uint8_t, LINES> codeLines{};
+	std::array<std::vector<int16_t>, LINES> lineBlocks{}; // indices into blocks
+
+	// profiles of blocks compiled with profiling, by guest PC. entry counters count down from HOT_ENTRIES, a loop
+	// back to the block's start enters it again, so iterations count too. the bias of a skip ending a block is
+	// counted up when it's taken and down when it isn't.
+	static constexpr uint32_t HOT_ENTRIES = 4096;
+
+	std::array<uint32_t, ChipState::RAM_SIZE> entryCounters{};
+	std::array<int32_t, ChipState::RAM_SIZE> skipBias{};
+	std::array<uint8_t, ChipState::RAM_SIZE> hotBlocks{}; // compiled with their profile from now on
+
+	// left the baseline tier, the entry counters of baseline blocks count down to their tier-up. a block whose code
+	// is rewritten starts in the baseline tier again.
+	std::array<uint8_t, ChipState::RAM_SIZE> warmBlocks{};
+
+	ChipJITState()
+	{
+		entryCounters.fill(HOT_ENTRIES);
+	}
+
+	// calls func with each line of the block's ranges.
+	template <typename Func>
+	inline void forEachLine(const JITBlock& block, Func func)
+	{
+		for (const auto& range : block.ranges)
+		{
+			if (range.end == range.start) continue;
+
+			for (int line = range.start >> LINE_SHIFT; line <= (range.end - 1) >> LINE_SHIFT; line++)
+				func(line & (LINES - 1));
+		}
+	}
+
+	inline const uint8_t* loadEntry(uint16_t pc)
+	{
+		return std::atomic_ref(blockEntries[pc]).load(std::memory_order_acquire);
+	}
+
+	inline void storeEntry(uint16_t pc, const uint8_t* code)
+	{
+		std::atomic_ref(blockEntries[pc]).store(code, std::memory_order_release);
+	}
+
+	inline void addBlockLines(int16_t index)
+	{
+		forEachLine(blocks[index], [&](int line) {
+			auto& indices = lineBlocks[line];
+
+			if (std::find(indices.begin(), indices.end(), index) == indices.end())
+				indices.push_back(index);
+
+			codeLines[line] = 1;
+		});
+	}
+
+	inline void removeBlockLines(int16_t index)
+	{
+		forEachLine(blocks[index], [&](int line) {
+			std::erase(lineBlocks[line], index);
+			codeLines[line] = !lineBlocks[line].empty();
+		});
+	}
+
+	// the index is baked into the site's code, so entries aren't moved. a free one is reused before the table grows.
+	inline uint32_t addInlineCache(const InlineCache& cache)
+	{
+		const auto free = std::find_if(inlineCaches.begin(), inlineCaches.end(), [](const InlineCache& entry) { return entry.block == -1; });
+
+		if (free != inlineCaches.end())
+		{
+			*free = cache;
+			return static_cast<uint32_t>(free - inlineCaches.begin());
+		}
+
+		inlineCaches.push_back(cache);
+		return static_cast<uint32_t>(inlineCaches.size() - 1);
+	}
+
+	// the block's code is dead once it's dropped, counted copy included.
+	inline void freeInlineCaches(int16_t index)
+	{
+		for (auto& cache : inlineCaches)
+		{
+			if (cache.block == index) cache = InlineCache{};
+		}
+	}
+
 	inline void reset()
 	{
 		blocks.clear();
 		std::fill(blockMap.begin(), blockMap.end(), JITMapEntry{});
+		blockEntries.fill(nullptr);
+		countedEntries.fill(nullptr);
+		shadowStack.fill(ShadowReturn{});
+		inlineCaches.clear();
+		relocations.clear();
+		codeLines.fill(0);
+
+		entryCounters.fill(HOT_ENTRIES);
+		skipBias.fill(0);
+		hotBlocks.fill(0);
+		warmBlocks.fill(0);
+
+		for (auto& links : blockLinks)
+			links.clear();
+
+		for (auto& indices : lineBlocks)
+			indices.clear();
 	}
 };
\ No newline at end of file
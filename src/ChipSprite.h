@@ -0,0 +1,32 @@
+#pragma once
+
+#include <cstdint>
+#include <algorithm>
+#include <bit>
+
+#include "ChipState.h"
+
+// DXYN shared by both cores, the JIT emits the same kernel inline (see ChipEmitter::emitDXYN()).
+// every row is moved into place with one rotate (or shift when clipping) instead of branching on partial draws,
+// and collisions are accumulated over the whole sprite and tested once.
+namespace ChipSprite
+{
+	// draws the sprite at I with X and Y already wrapped to the screen, returns the collision flag.
+	inline uint8_t draw(ChipState& state, uint8_t x, uint8_t y, uint8_t height, bool clipping)
+	{
+		const int count = clipping ? std::min<int>(height, ChipState::SCRHeight - y) : height;
+		uint64_t collision = 0;
+
+		for (int i = 0; i < count; i++)
+		{
+			const uint64_t row = static_cast<uint64_t>(state.RAM[(state.I + i) & 0xFFF]) << 56;
+			const uint64_t mask = clipping ? row >> x : std::rotr(row, x);
+
+			uint64_t& screenRow = state.screenBuffer[(y + i) & (ChipState::SCRHeight - 1)];
+			collision |= screenRow & mask;
+			screenRow ^= mask;
+		}
+
+		return collision != 0;
+	}
+}
@@ -16,4 +16,10 @@ namespace Quirks
 		Shifting = true;
 		Jumping = false;
 	}
+
+	// one bit per quirk, code compiled with one set doesn't run with another.
+	inline uint8_t Pack()
+	{
+		return VFReset | (MemoryIncrement << 1) | (Clipping << 2) | (Shifting << 3) | (Jumping << 4);
+	}
 }
\ No newline at end of file
@@ -12,11 +12,14 @@
 #include <iostream>   
 #include <filesystem>
 #include <thread>
+#include <string_view>
+#include <algorithm>
 
 #include "Shader.h"
 #include "resources.h"
 #include "ChipInterpretCore.h"
 #include "ChipJITCore.h"
+#include "ChipAOT.h"
 
 constexpr const char* APP_NAME = "MegaJIT-8";
 
@@ -140,11 +143,11 @@ void cpuThreadExecute()
 {
     uint64_t threadInstructions{ 0 };
 
-    while (CPUThreadRunning) [[likely]]
+    if constexpr (JIT)
+        threadInstructions = chipJITCore.execute(CPUThreadRunning); // returns once the thread is stopped.
+    else
     {
-        if constexpr (JIT)
-            threadInstructions += chipJITCore.execute();
-        else
+        while (CPUThreadRunning) [[likely]]
         {
             chipInterpretCore.execute();
             threadInstructions++;
@@ -171,10 +174,16 @@ void loadROM(const std::filesystem::path& path)
     if (CPUThreadRunning)
         stopCPUThread();
 
+    chipJITCore.saveCodeCache();
+
     if (chipCore->loadROM(path))
     {
         paused = false;
         currentROMPAth = path;
+        chipJITCore.loadCodeCache();
+
+        if (JITMode)
+            chipJITCore.precompile();
     }
 
     if (unlimitedMode)
@@ -215,6 +224,142 @@ inline void clearJITcache()
     if (threadRunning) startCPUThread();
 }
 
+inline void setCPUTier(CPUTier tier)
+{
+    bool threadRunning = CPUThreadRunning;
+    if (threadRunning) stopCPUThread();
+
+    chipJITCore.setCPUTier(tier);
+    if (threadRunning) startCPUThread();
+}
+
+inline void setTieredCompilation(bool enabled)
+{
+    bool threadRunning = CPUThreadRunning;
+    if (threadRunning) stopCPUThread();
+
+    chipJITCore.setTieredCompilation(enabled);
+    if (threadRunning) startCPUThread();
+}
+
+inline void setProfileGuided(bool enabled)
+{
+    bool threadRunning = CPUThreadRunning;
+    if (threadRunning) stopCPUThread();
+
+    chipJITCore.setProfileGuided(enabled);
+    if (threadRunning) startCPUThread();
+}
+
+inline void setBaselineTier(bool enabled)
+{
+    bool threadRunning = CPUThreadRunning;
+    if (threadRunning) stopCPUThread();
+
+    chipJITCore.setBaselineTier(enabled);
+    if (threadRunning) startCPUThread();
+}
+
+// writes <rom>.cpp for the headless runner, see ChipAOTRunner.cpp.
+bool compileAOT(const std::filesystem::path& romPath)
+{
+    if (!chipInterpretCore.loadROM(romPath))
+    {
+        std::cout << "Failed to load " << romPath.string() << std::endl;
+        return false;
+    }
+
+    std::filesystem::path outPath = romPath;
+    outPath += ".cpp";
+
+    std::ofstream out(outPath);
+
+    if (!out || !ChipAOT::generate(s.RAM, romPath.filename().string(), out))
+    {
+        std::cout << "Failed to write " << outPath.string() << std::endl;
+        return false;
+    }
+
+    std::cout << "Wrote " << outPath.string() << std::endl;
+    return true;
+}
+
+// --cpu <tier> limits the instruction set the JIT generates code for, to compare tiers on one machine.
+// --code-cache <dir> keeps the compiled code of each ROM in dir, later runs of the same ROM start with it.
+// --aot <rom> compiles the ROM ahead of time and exits.
+// --tiered interprets cold code and compiles hot blocks on a separate thread.
+// --pgo profiles compiled blocks and recompiles the hot ones with what was observed.
+// --baseline copies blocks from precompiled stencils the first time they run, only hot ones are compiled.
+void parseArgs(int argc, char* argv[])
+{
+    for (int i = 1; i < argc; i++)
+    {
+        std::string_view arg{ argv[i] };
+        std::string_view value{};
+
+        const auto option = [&](std::string_view name)
+        {
+            if (arg.starts_with(name) && arg.size() > name.size() && arg[name.size()] == '=')
+                value = arg.substr(name.size() + 1);
+            else if (arg == name && i + 1 < argc)
+                value = argv[++i];
+            else
+                return false;
+
+            return true;
+        };
+
+        if (arg == "--tiered")
+        {
+            chipJITCore.setTieredCompilation(true);
+            continue;
+        }
+
+        if (arg == "--pgo")
+        {
+            chipJITCore.setProfileGuided(true);
+            continue;
+        }
+
+        if (arg == "--baseline")
+        {
+            chipJITCore.setBaselineTier(true);
+            continue;
+        }
+
+        if (option("--code-cache"))
+        {
+            chipJITCore.setCodeCacheDir(value);
+            continue;
+        }
+
+        if (option("--aot"))
+            std::exit(compileAOT(value) ? 0 : 1);
+
+        if (!option("--cpu"))
+        {
+            std::cout << "Unknown argument: " << arg << std::endl;
+            continue;
+        }
+
+        const auto it = std::find(CPU_TIER_NAMES.begin(), CPU_TIER_NAMES.end(), value);
+
+        if (it == CPU_TIER_NAMES.end())
+        {
+            std::cout << "Unknown CPU tier: " << value << ", expected one of:";
+            for (const char* name : CPU_TIER_NAMES) std::cout << " " << name;
+            std::cout << std::endl;
+            continue;
+        }
+
+        const CPUTier tier = static_cast<CPUTier>(it - CPU_TIER_NAMES.begin());
+        chipJITCore.setCPUTier(tier);
+
+        if (tier > chipJITCore.getHostCPUTier())
+            std::cout << "CPU tier " << value << " is not supported, using " << CPU_TIER_NAMES[static_cast<size_t>(chipJITCore.getHostCPUTier())] << std::endl;
+    }
+}
+
 void renderImGUI()
 {
     ImGui_ImplOpenGL3_NewFrame();
@@ -361,6 +506,34 @@ void renderImGUI()
 
                 if (ImGui::Button("Clear Cache"))
                     clearJITcache();
+
+                const size_t currentTier = static_cast<size_t>(chipJITCore.getCPUTier());
+
+                if (ImGui::BeginCombo("Code Tier", CPU_TIER_NAMES[currentTier]))
+                {
+                    for (size_t i = 0; i <= static_cast<size_t>(chipJITCore.getHostCPUTier()); i++)
+                    {
+                        if (ImGui::Selectable(CPU_TIER_NAMES[i], i == currentTier) && i != currentTier)
+                            setCPUTier(static_cast<CPUTier>(i));
+                    }
+
+                    ImGui::EndCombo();
+                }
+
+                bool tiered = chipJITCore.getTieredCompilation();
+
+                if (ImGui::Checkbox("Tiered Compilation", &tiered))
+                    setTieredCompilation(tiered);
+
+                bool profileGuided = chipJITCore.getProfileGuided();
+
+                if (ImGui::Checkbox("Profile Guided", &profileGuided))
+                    setProfileGuided(profileGuided);
+
+                bool baselineTier = chipJITCore.getBaselineTier();
+
+                if (ImGui::Checkbox("Baseline Tier", &baselineTier))
+                    setBaselineTier(baselineTier);
             }
             else
             {
@@ -393,7 +566,6 @@ void renderImGUI()
                     }
                 }
 
-                chipJITCore.setSlowMode(!unlimitedMode);
                 if (startThread) startCPUThread();
             }
 
@@ -639,8 +811,10 @@ void setImGUI()
     ImGui_ImplOpenGL3_Init("#version 330");
 }
 
-int main()
+int main(int argc, char* argv[])
 {
+    parseArgs(argc, argv);
+
     if (!setGLFW()) return -1;
     setImGUI();
     NFD_Init();
@@ -674,12 +848,12 @@ int main()
 
                 if (!unlimitedMode)
                 {
-                    for (int i = 0; i < IPF; i++)
+                    if (JITMode)
+                        chipJITCore.execute(IPF);
+                    else
                     {
-                        if (JITMode)
-							chipJITCore.execute();
-						else
-							chipInterpretCore.execute();			
+                        for (int i = 0; i < IPF; i++)
+                            chipInterpretCore.execute();
                     }
                 }
             }
@@ -724,5 +898,6 @@ int main()
     if (CPUThreadRunning)
         stopCPUThread();
 
+    chipJITCore.saveCodeCache();
     return 0;
 }
\ No newline at end of file